@@ -87,20 +87,111 @@ private:
   char *pos_;
 };
 
+// A live stream over a socket (Unix-domain or TCP) or a pipe, for content
+// rendered by another process or host.
+//
+// Reading never blocks: all data available is drained from the connection
+// and only the most recent complete frame is handed to the StreamReader;
+// frames that arrived in the meantime are dropped, so a slow consumer does
+// not accumulate latency. If no new frame is available, Read() returns 0,
+// so StreamReader::GetNext() returns false and you keep showing the
+// current frame.
+//
+// Writing blocks until all data is sent. Use a StreamWriter without
+// duplicate-frame folding on the producer side so that every frame is sent
+// right away.
+class SocketStreamIO : public StreamIO {
+public:
+  struct Stats {
+    uint64_t frames_received;  // Complete frames arrived.
+    uint64_t frames_dropped;   // .. of which were replaced by a newer one.
+    // Latency between the StreamWriter sending a frame and it being read by
+    // the StreamReader. Needs synchronized clocks if on different hosts.
+    uint32_t last_latency_us;
+    uint32_t max_latency_us;
+  };
+
+  // Takes ownership of the file descriptor; it is set to non-blocking.
+  // Only streams with frames of the size of "frame" are accepted; the
+  // connection is closed if the peer sends anything else.
+  SocketStreamIO(int fd, const FrameCanvas &frame);
+  ~SocketStreamIO();
+
+  // Connect to "address", which is either a path of a Unix-domain socket
+  // (contains a '/') or a "host:port" TCP address. Returns NULL on failure.
+  static SocketStreamIO *Connect(const char *address,
+                                 const FrameCanvas &frame);
+
+  // Listen on "address" (as above; host can be empty for all interfaces)
+  // and wait for the producer to connect. Returns NULL on failure.
+  static SocketStreamIO *Accept(const char *address,
+                                const FrameCanvas &frame);
+
+  // Live streams can't go back in time; this only makes the stream header
+  // available again to the next reader.
+  void Rewind() final;
+  ssize_t Read(void *buf, size_t count) final;
+  ssize_t Append(const void *buf, size_t count) final;
+
+  // Returns 'true' as long as the peer did not close the connection and
+  // sent a stream that matches our frames.
+  bool IsConnected() const { return connected_; }
+  const Stats &GetStats() const { return stats_; }
+
+private:
+  bool ReceiveAvailable();
+  void ExtractLatestFrame();
+  void Disconnect();
+
+  const int fd_;
+  bool connected_;
+  Stats stats_;
+
+  std::string received_;      // Raw bytes received, not yet parsed.
+  std::string file_header_;   // Stream header; sent once per Rewind().
+  size_t file_header_pos_;
+  size_t frame_size_;         // Expected frame header + frame data.
+  std::string latest_frame_;  // Most recent complete frame.
+  bool has_latest_frame_;
+  size_t frame_pos_;          // Position while handing out latest_frame_.
+};
+
 class StreamWriter {
 public:
   // Does not take ownership of StreamIO
-  StreamWriter(StreamIO *io);
+  //
+  // If "fold_duplicate_frames" is set, a frame that is byte-identical to the
+  // previous one is not written again, instead its "hold_time_us" is added
+  // to the previous frame. For that, the last frame is held back until
+  // a different frame arrives, Flush() is called or the writer is destroyed.
+  StreamWriter(StreamIO *io, bool fold_duplicate_frames = true);
+
+  // Writes a frame still held back (see Flush()), so the StreamIO must
+  // outlive the writer: destroy the writer before closing or deleting it.
+  ~StreamWriter();
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
   // for how long this frame is to be shown in microseconds.
   bool Stream(const FrameCanvas &frame, uint32_t hold_time_us);
 
+  // Write out a frame possibly held back for duplicate folding. Call this
+  // if you need the stream to be complete while keeping the writer around.
+  bool Flush();
+
 private:
   void WriteFileHeader(const FrameCanvas &frame, size_t len);
+  bool WriteFrame(const char *data, size_t len, uint32_t hold_time_us);
 
   StreamIO *const io_;
+  const bool fold_duplicate_frames_;
   bool header_written_;
+
+  // Last frame, not written yet as the next one might be identical.
+  char *pending_frame_;
+  size_t pending_len_;
+  uint64_t pending_hash_;
+  uint32_t pending_hold_time_us_;
+  bool has_pending_;
 };
 
 class StreamReader {
@@ -114,8 +205,21 @@ public:
 
   // Get next frame and its timestamp. Returns 'false' if there is an error
   // or end of stream reached..
+  // Frames that don't match their checksum are skipped.
   bool GetNext(FrameCanvas *frame, uint32_t* hold_time_us);
 
+  // Verify the per-frame checksums (default: on). Can be switched off on
+  // trusted media. Streams written by older versions don't have checksums.
+  void set_verify_checksums(bool on) { verify_checksums_ = on; }
+  bool verify_checksums() const { return verify_checksums_; }
+
+  // Number of frames skipped so far because of checksum mismatch.
+  uint64_t corrupt_frames() const { return corrupt_frames_; }
+
+  // Number of PWM bits the stream was recorded with. Only known after the
+  // first GetNext(); 0 if the stream does not tell (older streams).
+  uint8_t pwm_bits() const { return pwm_bits_; }
+
 private:
   enum State {
     STREAM_AT_BEGIN,
@@ -126,8 +230,25 @@ private:
 
   StreamIO *io_;
   size_t frame_buf_size_;
+  uint8_t pwm_bits_;
+  bool has_checksums_;
+  bool verify_checksums_;
+  uint64_t corrupt_frames_;
   State state_;
 
   char *header_frame_buffer_;
 };
+
+// Re-encode the stream read from "in" for a different matrix configuration
+// and write it to "out" in a single pass.
+//
+// "from" needs to be a FrameCanvas with the configuration the stream was
+// recorded with (size, pixel mappers, hardware mapping, parallel); it is
+// used to decode each frame back to RGB. "to" is a FrameCanvas of the
+// target configuration, all frames are re-encoded with its settings.
+// If sizes differ, the overlapping top-left area is copied.
+//
+// Returns 'true' if at least one frame was transcoded and written.
+bool TranscodeStream(StreamIO *in, FrameCanvas *from,
+                     StreamIO *out, FrameCanvas *to);
 }
@@ -12,7 +12,10 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#include <map>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace rgb_matrix {
 struct Color {
@@ -31,8 +34,16 @@ public:
   Font();
   ~Font();
 
+  // Load a BDF font, or a compiled font written by WriteCompiledFont().
+  // A compiled font is memory mapped and used as-is: there is no parsing,
+  // glyphs are only paged in when drawn and processes share the memory.
+  // It replaces any glyphs loaded before.
   bool LoadFont(const char *path);
 
+  // Write the loaded font in the compiled format. The file is specific to
+  // the machine architecture. See utils/font-compiler.
+  bool WriteCompiledFont(const char *path) const;
+
   // Return height of font in pixels. Returns -1 if font has not been loaded.
   int height() const { return font_height_; }
 
@@ -70,14 +81,54 @@ public:
 private:
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
-  struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
+  // Glyph metrics. The bitmap lives in the shared atlas: "height" rows of
+  // "words_per_row" 32 bit words, leftmost pixel in the most significant bit.
+  // Stored as-is in compiled font files.
+  struct Glyph {
+    uint32_t codepoint;
+    int32_t device_width, device_height;
+    int32_t width, height;
+    int32_t x_offset, y_offset;
+    int32_t words_per_row;
+    uint32_t bitmap;  // Offset of the first row in bitmap_words_.
+  };
+  struct IndexEntry {
+    uint32_t codepoint;
+    int32_t glyph;
+  };
+
+  // Codepoints below this are looked up directly; covers ASCII and Latin-1.
+  static constexpr int kDirectGlyphs = 256;
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
 
+  // Rebuild the lookup tables from glyph_storage_ and use the storage
+  // vectors. Later glyphs with the same codepoint replace earlier ones.
+  void BuildIndex();
+
+  bool MapCompiledFont(const char *path);
+  void CopyMappedFont();  // Copy mapped tables to storage and unmap.
+
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+
+  // The tables in use. They point into the storage below, or into the
+  // memory mapped compiled font file.
+  const Glyph *glyphs_;
+  size_t num_glyphs_;
+  const uint32_t *bitmap_words_;
+  size_t num_bitmap_words_;
+  const int32_t *direct_index_;  // kDirectGlyphs indexes into glyphs_ or -1.
+  const IndexEntry *sorted_index_;  // The other codepoints, sorted.
+  size_t num_sorted_;
+
+  std::vector<Glyph> glyph_storage_;
+  std::vector<uint32_t> bitmap_storage_;
+  int32_t direct_storage_[kDirectGlyphs];
+  std::vector<IndexEntry> sorted_storage_;
+
+  void *mapped_file_;  // Non-NULL if tables are in a mapped file.
+  size_t mapped_size_;
 };
 
 // -- Some utility functions.
@@ -121,6 +172,61 @@ int DrawText(Canvas *c, const Font &font, int x, int y,
 int DrawText(Canvas *c, const Font &font, int x, int y, const Color &color,
              const char *utf8_text);
 
+// Keeps text drawn with DrawText() as pre-rendered sprites, for text that is
+// drawn over and over again, such as labels or status overlays. Each text is
+// only rendered once and then written to the canvas in spans of pixels.
+//
+// Sprites are one bit masks, so they don't depend on the colors. Sprites
+// least recently drawn are dropped to stay within "memory_budget" bytes.
+// Fonts need to outlive their cached sprites; call Clear() before deleting
+// a font that was drawn with.
+class TextCache {
+public:
+  explicit TextCache(size_t memory_budget = 256 << 10);
+  ~TextCache();
+
+  // Same as DrawText() above, including the clipping at the canvas border
+  // and the returned advance.
+  int DrawText(Canvas *c, const Font &font, int x, int y,
+               const Color &color, const Color *background_color,
+               const char *utf8_text, int kerning_offset = 0);
+
+  // Bytes used by all cached sprites.
+  size_t memory_used() const { return memory_used_; }
+
+  // Drop all cached sprites.
+  void Clear();
+
+private:
+  TextCache(const TextCache&);  // No copy constructor.
+
+  struct Sprite {
+    std::string key;
+    int x, y;  // Top left corner, relative to the text origin.
+    int width, height;
+    int words_per_row;
+    int advance;   // What DrawText() returns.
+    size_t bytes;  // Counted towards the memory budget.
+    // Pixels in the foreground color. If drawn with background, "covered"
+    // has all pixels written, otherwise it is empty.
+    std::vector<uint32_t> foreground;
+    std::vector<uint32_t> covered;
+  };
+  typedef std::list<Sprite> SpriteList;  // Most recently used first.
+
+  void Render(const Font &font, const Color *background_color,
+              const char *utf8_text, int kerning_offset, Sprite *sprite);
+  void Blit(Canvas *c, const Sprite &sprite, int x, int y,
+            const Color &color, const Color *background_color);
+
+  const size_t memory_budget_;
+  size_t memory_used_;
+  SpriteList sprites_;
+  std::unordered_map<std::string, SpriteList::iterator> index_;
+  std::string key_;          // Scratch space for the lookup key.
+  std::vector<Color> span_;  // Scratch space for writing spans.
+};
+
 // Draw text, a standard NUL terminated C-string encoded in UTF-8,
 // with given "font" at "x","y" with "color".
 // Draw text as above, but vertically (top down).
@@ -158,6 +158,11 @@ struct RGBLedMatrixOptions {
    * processes when waiting and renders single core boards more responsive.
    */
   bool disable_busy_waiting;     /* Corresponding flag: --led-busy-waiting */
+
+  /* Directory to cache the final pixel mapping in, for faster startup.
+   * NULL or empty for no cache.
+   */
+  const char *pixel_map_cache_dir; /* Corresponding flag: --led-pixel-map-cache */
 };
 
 /**
@@ -359,6 +364,12 @@ struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix);
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix, uint8_t brightness);
 
+// Scale light output of everything shown, without re-drawing; see
+// RGBMatrix::SetOutputBrightness().
+uint8_t led_matrix_get_output_brightness(struct RGBLedMatrix *matrix);
+void led_matrix_set_output_brightness(struct RGBLedMatrix *matrix,
+                                      uint8_t percent);
+
 // Utility function: set an image from the given buffer containting pixels.
 //
 // Draw image of size "image_width" and "image_height" from pixel at
@@ -382,7 +393,8 @@ void set_image(struct LedCanvas *c, int canvas_offset_x, int canvas_offset_y,
                int image_width, int image_height,
                char is_bgr);
 
-// Load a font given a path to a font file containing a bdf font.
+// Load a font given a path to a font file containing a bdf font, or a
+// compiled font (see utils/font-compiler).
 struct LedFont *load_font(const char *bdf_font_file);
 
 // Read the baseline of a font
@@ -60,6 +60,11 @@ public:
     // Returns 'true' if all options look good.
     bool Validate(std::string *err) const;
 
+    // Returns a key that changes with every option that changes the bits of
+    // serialized frames (see FrameCanvas::Serialize()), including the
+    // content of Table mapping files. Useful to name caches of frames.
+    uint64_t FrameEncodingKey() const;
+
     // Name of the hardware mapping. Something like "regular" or "adafruit-hat"
     const char *hardware_mapping;
 
@@ -159,6 +164,13 @@ public:
     // Sleep instead of busy wait to free CPU cycles but get slightly less
     // accurate frame timing.
     bool disable_busy_waiting;   // Flag: --led-busy-waiting
+
+    // Directory to keep a cache of the final pixel mapping in. With many
+    // panels and pixel mappers, computing the mapping takes a noticeable
+    // time at startup; with the cache, it is loaded directly on next start.
+    // The cache is keyed by the options influencing the mapping.
+    // NULL or empty to not use a cache.
+    const char *pixel_map_cache_dir;   // Flag: --led-pixel-map-cache
   };
 
   // Factory to create a matrix. Additional functionality includes dropping
@@ -270,6 +282,15 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Scale the light output in percent, 1%..100%, independent of the content.
+  // Unlike SetBrightness(), this affects whatever is shown with the next
+  // refresh, including frames that were Deserialize()d or come from a
+  // StreamReader; nothing needs to be re-drawn. It works by shortening the
+  // output-enable pulses, so at very low values, the lowest bit-planes
+  // become too short to show and color depth is reduced.
+  void SetOutputBrightness(uint8_t percent);
+  uint8_t output_brightness();
+
   //-- GPIO interaction.
   // This library uses the GPIO pins to drive the matrix; this is a safe way
   // to request the 'remaining' bits to be used for user purposes.
@@ -344,7 +365,7 @@ public:
   // Lower require less CPU.
   // Returns boolean to signify if value was within range.
   bool SetPWMBits(uint8_t value);
-  uint8_t pwmbits();
+  uint8_t pwmbits() const;
 
   // Map brightness of output linearly to input with CIE1931 profile.
   void set_luminance_correct(bool on);
@@ -377,6 +398,24 @@ public:
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // Read back the color of the pixel at "x", "y" by decoding the bitplanes
+  // with the current pwm-bits, brightness and luminance settings.
+  // This is lossy: the result is the 24bpp color that would be stored
+  // the same way, not necessarily the one originally passed to SetPixel().
+  // Pixels outside the canvas read as black.
+  void GetPixel(int x, int y, uint8_t *red, uint8_t *green, uint8_t *blue);
+
+  // Scroll the content horizontally without re-drawing it: the column
+  // drawn at "x" is shown at (x - offset) modulo width. So increasing the
+  // offset scrolls to the left, and the columns that wrap around on the right
+  // can be re-drawn with new content.
+  // This is applied while sending the frame to the panels, so it can be
+  // changed while this canvas is shown and takes effect with the next
+  // refresh. This works on plain chains; multiplexing or pixel mappers that
+  // re-arrange columns (e.g. U-mapper, Rotate:90) will scramble the content.
+  void SetScrollOffset(int offset);
+  int scroll_offset() const;
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
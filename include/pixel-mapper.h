@@ -15,6 +15,8 @@
 #ifndef RGBMATRIX_PIXEL_MAPPER
 #define RGBMATRIX_PIXEL_MAPPER
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -105,6 +107,20 @@ std::vector<std::string> GetAvailablePixelMappers();
 const PixelMapper *FindPixelMapper(const char *name,
                                    int chain, int parallel,
                                    const char *parameter = NULL);
+
+// Header of a binary mapping file for the "Table" mapper, which maps each
+// visible pixel with a lookup, e.g. --led-pixel-mapper=Table:/path/to/file
+// It is followed by a uint16_t matrix_x, matrix_y pair for each visible
+// pixel, row by row. The mapper also reads the same in a text format; see
+// utils/pixel-mapper-table which creates these files from a mapper chain.
+static const uint32_t kPixelMapperTableMagic = 0x54584D50;  // "PMXT"
+struct PixelMapperTableHeader {
+  uint32_t magic;
+  int32_t matrix_width;
+  int32_t matrix_height;
+  int32_t visible_width;
+  int32_t visible_height;
+};
 }  // namespace rgb_matrix
 
 #endif  // RGBMATRIX_PIXEL_MAPPER
@@ -20,30 +20,28 @@
 #include <inttypes.h>
 
 #include "graphics.h"
+#include "led-matrix.h"
+#include "bitmap-internal.h"
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
-#include <bitset>
+#include <string>
 #include <vector>
 
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 
 namespace rgb_matrix {
-// Bitmap for one row. This limits the number of available columns.
+// Maximum number of columns of a glyph we keep.
 // Make wider if running into trouble.
 static constexpr int kMaxFontWidth = 196;
-typedef std::bitset<kMaxFontWidth> rowbitmap_t;
-
-struct Font::Glyph {
-  int device_width, device_height;
-  int width, height;
-  int x_offset, y_offset;
-  std::vector<rowbitmap_t> bitmap;  // contains 'height' elements.
-};
 
 static bool readNibble(char c, uint8_t* val) {
   if (c >= '0' && c <= '9') { *val = c - '0'; return true; }
@@ -52,26 +50,45 @@ static bool readNibble(char c, uint8_t* val) {
   return false;
 }
 
-static bool parseBitmap(const char *buffer, rowbitmap_t* result) {
-  // Read the bitmap left-aligned to our buffer.
-  for (int pos = result->size() - 1; *buffer && pos >= 3; buffer+=1) {
+static bool parseBitmap(const char *buffer, int columns, uint32_t *row) {
+  // Read the bitmap left-aligned to our row, a nibble never straddles words.
+  const int words = WordsPerRow(columns);
+  for (int x = 0; *buffer && x < kMaxFontWidth && (x >> 5) < words;
+       buffer += 1, x += 4) {
     uint8_t val;
     if (!readNibble(*buffer, &val))
       break;
-    (*result)[pos--] = val & 0x8;
-    (*result)[pos--] = val & 0x4;
-    (*result)[pos--] = val & 0x2;
-    (*result)[pos--] = val & 0x1;
+    row[x >> 5] |= (uint32_t)val << (28 - (x & 31));
   }
+  if (columns % 32)  // Padding beyond what we keep.
+    row[words - 1] &= ~(~0u >> (columns % 32));
   return true;
 }
 
-Font::Font() : font_height_(-1), base_line_(0) {}
+namespace {
+// A compiled font file is the header, followed by the direct index, the
+// glyphs, the sorted index and the bitmap words. All of them are used
+// as-is when memory mapped.
+static const uint32_t kFontFileMagic = 0x46544231;
+struct FontFileHeader {
+  uint32_t magic;
+  uint32_t glyph_size;  // Rejects files of a different layout.
+  int32_t font_height;
+  int32_t base_line;
+  uint32_t num_glyphs;
+  uint32_t num_sorted;
+  uint32_t num_bitmap_words;
+  uint32_t reserved;
+};
+}
+
+Font::Font()
+  : font_height_(-1), base_line_(0), mapped_file_(NULL), mapped_size_(0) {
+  BuildIndex();
+}
+
 Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    delete it->second;
-  }
+  if (mapped_file_) munmap(mapped_file_, mapped_size_);
 }
 
 // TODO: that might not be working for all input files yet.
@@ -80,11 +97,23 @@ bool Font::LoadFont(const char *path) {
   FILE *f = fopen(path, "r");
   if (f == NULL)
     return false;
+  uint32_t magic = 0;
+  if (fread(&magic, sizeof(magic), 1, f) == 1 && magic == kFontFileMagic) {
+    fclose(f);
+    return MapCompiledFont(path);
+  }
+  rewind(f);
+  CopyMappedFont();  // Parsed glyphs are added to what we have.
+
   uint32_t codepoint;
   char buffer[1024];
   int dummy;
   Glyph tmp;
-  Glyph *current_glyph = NULL;
+  memset(&tmp, 0, sizeof(tmp));
+  bool have_glyph = false;
+  Glyph current_glyph;
+  int current_columns = 0;
+  std::vector<uint32_t> current_bitmap;
   int row = 0;
 
   while (fgets(buffer, sizeof(buffer), f)) {
@@ -97,82 +126,268 @@ bool Font::LoadFont(const char *path) {
     }
     else if (sscanf(buffer, "DWIDTH %d %d", &tmp.device_width, &tmp.device_height
                     ) == 2) {
-      // Limit to width we can actually display, limited by rowbitmap_t
+      // Limit to width we can actually display.
       tmp.device_width = std::min(tmp.device_width, kMaxFontWidth);
       // parsed.
     }
     else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
                     &tmp.x_offset, &tmp.y_offset) == 4) {
-      current_glyph = new Glyph();
-      *current_glyph = tmp;
-      current_glyph->bitmap.resize(tmp.height);
+      current_glyph = tmp;
+      // Keep all columns we might draw and the bitmap's byte padding.
+      current_columns = std::min(kMaxFontWidth,
+                                 std::max(tmp.device_width,
+                                          (tmp.width + 7) & ~7));
+      current_glyph.words_per_row = WordsPerRow(current_columns);
+      current_bitmap.assign(std::max(0, tmp.height)
+                            * current_glyph.words_per_row, 0);
+      have_glyph = true;
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
-    else if (current_glyph && row >= 0 && row < current_glyph->height
-             && parseBitmap(buffer, &current_glyph->bitmap[row])) {
+    else if (have_glyph && row >= 0 && row < current_glyph.height
+             && parseBitmap(buffer, current_columns,
+                            &current_bitmap[row * current_glyph.words_per_row])) {
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
-      if (current_glyph && row == current_glyph->height) {
-        delete glyphs_[codepoint];  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
-        current_glyph = NULL;
+      if (have_glyph && row == current_glyph.height) {
+        current_glyph.codepoint = codepoint;
+        current_glyph.bitmap = bitmap_storage_.size();
+        bitmap_storage_.insert(bitmap_storage_.end(),
+                               current_bitmap.begin(), current_bitmap.end());
+        glyph_storage_.push_back(current_glyph);
+        have_glyph = false;
       }
     }
   }
   fclose(f);
+  BuildIndex();
   return true;
 }
 
+void Font::BuildIndex() {
+  std::fill(direct_storage_, direct_storage_ + kDirectGlyphs, -1);
+  sorted_storage_.clear();
+  for (size_t i = 0; i < glyph_storage_.size(); ++i) {
+    const uint32_t codepoint = glyph_storage_[i].codepoint;
+    if (codepoint < (uint32_t)kDirectGlyphs) {
+      direct_storage_[codepoint] = i;
+    } else {
+      const IndexEntry entry = { codepoint, (int32_t)i };
+      sorted_storage_.push_back(entry);
+    }
+  }
+
+  // Sorted by codepoint, then index; of duplicates, keep the last loaded.
+  std::sort(sorted_storage_.begin(), sorted_storage_.end(),
+            [](const IndexEntry &a, const IndexEntry &b) {
+              if (a.codepoint != b.codepoint) return a.codepoint < b.codepoint;
+              return a.glyph < b.glyph;
+            });
+  size_t out = 0;
+  for (size_t i = 0; i < sorted_storage_.size(); ++i) {
+    if (out > 0 && sorted_storage_[out-1].codepoint
+        == sorted_storage_[i].codepoint)
+      sorted_storage_[out-1] = sorted_storage_[i];
+    else
+      sorted_storage_[out++] = sorted_storage_[i];
+  }
+  sorted_storage_.resize(out);
+
+  glyphs_ = glyph_storage_.data();
+  num_glyphs_ = glyph_storage_.size();
+  bitmap_words_ = bitmap_storage_.data();
+  num_bitmap_words_ = bitmap_storage_.size();
+  direct_index_ = direct_storage_;
+  sorted_index_ = sorted_storage_.data();
+  num_sorted_ = sorted_storage_.size();
+}
+
+bool Font::MapCompiledFont(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat s;
+  if (fstat(fd, &s) < 0 || s.st_size < (off_t)sizeof(FontFileHeader)) {
+    close(fd);
+    return false;
+  }
+  const size_t file_size = s.st_size;
+  void *mapped = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return false;
+
+  // Only the sizes are checked here; glyphs are checked when looked up, so
+  // that we don't touch all pages now.
+  const FontFileHeader *header = (const FontFileHeader*) mapped;
+  const uint64_t expected_size = sizeof(FontFileHeader)
+    + kDirectGlyphs * sizeof(int32_t)
+    + (uint64_t)header->num_glyphs * sizeof(Glyph)
+    + (uint64_t)header->num_sorted * sizeof(IndexEntry)
+    + (uint64_t)header->num_bitmap_words * sizeof(uint32_t);
+  if (header->magic != kFontFileMagic || header->glyph_size != sizeof(Glyph)
+      || header->num_glyphs > (uint32_t)INT32_MAX
+      || expected_size != file_size) {
+    fprintf(stderr, "%s: not a valid compiled font for this machine.\n",
+            path);
+    munmap(mapped, file_size);
+    return false;
+  }
+
+  if (mapped_file_) munmap(mapped_file_, mapped_size_);
+  glyph_storage_.clear();
+  bitmap_storage_.clear();
+  sorted_storage_.clear();
+  mapped_file_ = mapped;
+  mapped_size_ = file_size;
+
+  font_height_ = header->font_height;
+  base_line_ = header->base_line;
+  direct_index_ = (const int32_t*) (header + 1);
+  glyphs_ = (const Glyph*) (direct_index_ + kDirectGlyphs);
+  num_glyphs_ = header->num_glyphs;
+  sorted_index_ = (const IndexEntry*) (glyphs_ + num_glyphs_);
+  num_sorted_ = header->num_sorted;
+  bitmap_words_ = (const uint32_t*) (sorted_index_ + num_sorted_);
+  num_bitmap_words_ = header->num_bitmap_words;
+  return true;
+}
+
+void Font::CopyMappedFont() {
+  if (!mapped_file_) return;
+  glyph_storage_.assign(glyphs_, glyphs_ + num_glyphs_);
+  bitmap_storage_.assign(bitmap_words_, bitmap_words_ + num_bitmap_words_);
+  munmap(mapped_file_, mapped_size_);
+  mapped_file_ = NULL;
+  mapped_size_ = 0;
+  BuildIndex();
+}
+
+bool Font::WriteCompiledFont(const char *path) const {
+  FontFileHeader header;
+  header.magic = kFontFileMagic;
+  header.glyph_size = sizeof(Glyph);
+  header.font_height = font_height_;
+  header.base_line = base_line_;
+  header.num_glyphs = num_glyphs_;
+  header.num_sorted = num_sorted_;
+  header.num_bitmap_words = num_bitmap_words_;
+  header.reserved = 0;
+
+  // Write to a temporary file first, so that we never leave a partial
+  // file behind if we're interrupted.
+  const std::string tmp_path = std::string(path) + ".tmp";
+  FILE *out = fopen(tmp_path.c_str(), "wb");
+  if (out == NULL) return false;
+  bool success = (fwrite(&header, sizeof(header), 1, out) == 1);
+  success &= (fwrite(direct_index_, sizeof(int32_t), kDirectGlyphs, out)
+              == (size_t)kDirectGlyphs);
+  success &= (fwrite(glyphs_, sizeof(Glyph), num_glyphs_, out)
+              == num_glyphs_);
+  success &= (fwrite(sorted_index_, sizeof(IndexEntry), num_sorted_, out)
+              == num_sorted_);
+  success &= (fwrite(bitmap_words_, sizeof(uint32_t), num_bitmap_words_, out)
+              == num_bitmap_words_);
+  success &= (fclose(out) == 0);
+  if (success && rename(tmp_path.c_str(), path) == 0)
+    return true;
+  unlink(tmp_path.c_str());
+  return false;
+}
+
 Font *Font::CreateOutlineFont() const {
   Font *r = new Font();
   const int kBorder = 1;
   r->font_height_ = font_height_ + 2*kBorder;
   r->base_line_ = base_line_ + kBorder;
-  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    const Glyph *orig = it->second;
-    const int height = orig->height + 2 * kBorder;
-    Glyph *const tmp_glyph = new Glyph();
-    tmp_glyph->bitmap.resize(height);
-    tmp_glyph->width  = orig->width  + 2*kBorder;
-    tmp_glyph->height = height;
-    tmp_glyph->device_width  = orig->device_width + 2*kBorder;
-    tmp_glyph->device_height = height;
-    tmp_glyph->y_offset = orig->y_offset - kBorder;
+  for (size_t i = 0; i < num_glyphs_; ++i) {
+    const Glyph &orig = glyphs_[i];
+    if (FindGlyph(orig.codepoint) != &orig)
+      continue;  // Replaced by a later glyph, or broken.
+    Glyph g = orig;
+    g.width  = orig.width  + 2*kBorder;
+    g.height = orig.height + 2*kBorder;
+    g.device_width  = orig.device_width + 2*kBorder;
+    g.device_height = g.height;
+    g.y_offset = orig.y_offset - kBorder;
+    const int orig_columns = orig.words_per_row * 32;
+    g.words_per_row = WordsPerRow(
+      std::max(g.device_width,
+               std::min(kMaxFontWidth, orig_columns + 2*kBorder)));
+    g.bitmap = r->bitmap_storage_.size();
+    r->bitmap_storage_.resize(g.bitmap + g.height * g.words_per_row, 0);
+
     // TODO: we don't really need bounding box, right ?
-    const rowbitmap_t fill_pattern = 0b111;
-    const rowbitmap_t start_mask   = 0b010;
-    // Fill the border
-    for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t fill = fill_pattern;
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      for (rowbitmap_t m = start_mask; m.any(); m <<= 1, fill <<= 1) {
-        if ((orig_bitmap & m).any()) {
-          tmp_glyph->bitmap[h+kBorder-1] |= fill;
-          tmp_glyph->bitmap[h+kBorder+0] |= fill;
-          tmp_glyph->bitmap[h+kBorder+1] |= fill;
+    const uint32_t *in = bitmap_words_ + orig.bitmap;
+    uint32_t *out = r->bitmap_storage_.data() + g.bitmap;
+    // Fill the border around each pixel that is not shifted beyond
+    // kMaxFontWidth...
+    const int fill_columns = std::min(orig_columns, kMaxFontWidth - 2*kBorder);
+    for (int h = 0; h < orig.height; ++h) {
+      const uint32_t *in_row = in + h * orig.words_per_row;
+      for (int x = NextBit(in_row, 0, fill_columns, true); x < fill_columns;
+           x = NextBit(in_row, x + 1, fill_columns, true)) {
+        for (int dy = 0; dy <= 2*kBorder; ++dy) {
+          for (int dx = 0; dx <= 2*kBorder; ++dx) {
+            SetBit(out + (h + dy) * g.words_per_row, x + dx);
+          }
         }
       }
     }
-    // Remove original font again.
-    for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      tmp_glyph->bitmap[h+kBorder] &= ~orig_bitmap;
+    // ... then remove original font again.
+    const int clear_columns = std::min(orig_columns, kMaxFontWidth - kBorder);
+    for (int h = 0; h < orig.height; ++h) {
+      const uint32_t *in_row = in + h * orig.words_per_row;
+      for (int x = NextBit(in_row, 0, clear_columns, true); x < clear_columns;
+           x = NextBit(in_row, x + 1, clear_columns, true)) {
+        ClearBit(out + (h + kBorder) * g.words_per_row, x + kBorder);
+      }
     }
-    r->glyphs_[it->first] = tmp_glyph;
+    r->glyph_storage_.push_back(g);
   }
+  r->BuildIndex();
   return r;
 }
 
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  int32_t index;
+  if (unicode_codepoint < (uint32_t)kDirectGlyphs) {
+    index = direct_index_[unicode_codepoint];
+  } else {
+    const IndexEntry *end = sorted_index_ + num_sorted_;
+    const IndexEntry *found = std::lower_bound(
+      sorted_index_, end, unicode_codepoint,
+      [](const IndexEntry &e, uint32_t c) { return e.codepoint < c; });
+    if (found == end || found->codepoint != unicode_codepoint)
+      return NULL;
+    index = found->glyph;
+  }
+  if (index < 0 || (size_t)index >= num_glyphs_)
+    return NULL;
+
+  // Glyphs from a mapped file have not been looked at before. Keep metrics
+  // in a range in which drawing can't overflow.
+  static constexpr int32_t kMaxMetric = 1 << 16;
+  const auto out_of_range = [](int32_t v) {
+    return v < -kMaxMetric || v > kMaxMetric;
+  };
+  const Glyph *g = &glyphs_[index];
+  if (out_of_range(g->device_width) || out_of_range(g->device_height)
+      || out_of_range(g->width) || out_of_range(g->height)
+      || out_of_range(g->x_offset) || out_of_range(g->y_offset)
+      || g->words_per_row > kMaxMetric / 32) {
+    return NULL;
+  }
+  const int columns = std::min(g->device_width, kMaxFontWidth);
+  if (g->height < 0 || g->words_per_row < 0
+      || (g->height > 0 && g->words_per_row * 32 < columns)
+      || g->bitmap > num_bitmap_words_
+      || (uint64_t)g->height * g->words_per_row
+         > num_bitmap_words_ - g->bitmap) {
     return NULL;
-  return found->second;
+  }
+  return g;
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -193,14 +408,40 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
     return g->device_width;  // Outside canvas border. Bail out early.
   }
 
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t& row = g->bitmap[y];
-    for (int x = 0; x < g->device_width; ++x) {
-      if (row.test(kMaxFontWidth - 1 - x)) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
-        c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
+  // A FrameCanvas takes whole spans of pixels, clipping them itself.
+  const int width = std::min(g->device_width, kMaxFontWidth);
+  FrameCanvas *frame_canvas = (width >= kMinSetPixelsSpan)
+    ? dynamic_cast<FrameCanvas*>(c) : NULL;
+  Color span[kMaxFontWidth];
+  if (frame_canvas && !bgcolor)
+    std::fill(span, span + width, color);
+
+  const uint32_t *row = bitmap_words_ + g->bitmap;
+  for (int y = 0; y < g->height; ++y, row += g->words_per_row) {
+    if (bgcolor) {
+      // Every pixel of the row is written.
+      if (frame_canvas) {
+        for (int x = 0; x < width; ++x)
+          span[x] = TestBit(row, x) ? color : *bgcolor;
+        frame_canvas->SetPixels(x_pos, y_pos + y, width, 1, span);
+      } else {
+        for (int x = 0; x < width; ++x) {
+          const Color &col = TestBit(row, x) ? color : *bgcolor;
+          c->SetPixel(x_pos + x, y_pos + y, col.r, col.g, col.b);
+        }
+      }
+      continue;
+    }
+    // Transparent background: only runs of set pixels, skipping empty words.
+    for (int x = NextBit(row, 0, width, true); x < width; ) {
+      const int end = NextBit(row, x, width, false);
+      if (frame_canvas && end - x >= kMinSetPixelsSpan) {
+        frame_canvas->SetPixels(x_pos + x, y_pos + y, end - x, 1, span);
+      } else {
+        for (int i = x; i < end; ++i)
+          c->SetPixel(x_pos + i, y_pos + y, color.r, color.g, color.b);
       }
+      x = NextBit(row, end, width, true);
     }
   }
   return g->device_width;
@@ -0,0 +1,57 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_GRAPHICS_BITMAP_H
+#define RPI_GRAPHICS_BITMAP_H
+
+#include <stdint.h>
+
+#include <algorithm>
+
+// Rows of one bit pixels, as used by fonts and text sprites. Each row is
+// packed in 32 bit words, the leftmost pixel in the most significant bit.
+namespace rgb_matrix {
+// Writing a span with FrameCanvas::SetPixels() only pays off for longer
+// spans; shorter ones are cheaper to write pixel by pixel.
+static constexpr int kMinSetPixelsSpan = 16;
+
+static inline int WordsPerRow(int columns) { return (columns + 31) / 32; }
+
+static inline bool TestBit(const uint32_t *row, int x) {
+  return row[x >> 5] & (0x80000000u >> (x & 31));
+}
+
+static inline void SetBit(uint32_t *row, int x) {
+  row[x >> 5] |= 0x80000000u >> (x & 31);
+}
+
+static inline void ClearBit(uint32_t *row, int x) {
+  row[x >> 5] &= ~(0x80000000u >> (x & 31));
+}
+
+// Column of the first pixel at or after "x" that is set (or clear if "set"
+// is false). Looks at a whole word at a time. Returns "width" if none.
+static inline int NextBit(const uint32_t *row, int x, int width, bool set) {
+  const uint32_t invert = set ? 0 : ~0u;
+  while (x < width) {
+    const uint32_t word = (row[x >> 5] ^ invert) & (~0u >> (x & 31));
+    if (word)
+      return std::min(width, (x & ~31) + __builtin_clz(word));
+    x = (x & ~31) + 32;
+  }
+  return width;
+}
+}  // namespace rgb_matrix
+
+#endif  // RPI_GRAPHICS_BITMAP_H
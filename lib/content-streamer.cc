@@ -4,16 +4,30 @@
 #include "led-matrix.h"
 
 #include <cstddef>
+#include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
 #include <algorithm>
 
+#if defined(__x86_64__) || defined(__i386__)
+#  include <nmmintrin.h>
+#elif defined(__aarch64__) || defined(__arm__)
+#  include <sys/auxv.h>
+#endif
+
 #include "gpio-bits.h"
 
 namespace rgb_matrix {
@@ -32,9 +46,11 @@ struct FileHeader {
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
-  uint64_t future_use1;
+  uint64_t pwm_bits : 8;  // Bitplanes in use when recorded. 0: unknown.
+  uint64_t future_use1 : 56;
   uint64_t is_wide_gpio : 1;
-  uint64_t flags_future_use : 63;
+  uint64_t has_frame_checksums : 1;  // FrameHeader::crc32c is valid.
+  uint64_t flags_future_use : 62;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FileHeader) == 32);
 
@@ -43,11 +59,122 @@ struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
-  uint64_t future_use2;
+  uint32_t crc32c;        // Checksum of the frame data.
+  uint64_t timestamp_us;  // Wall-clock time written. 0: unknown.
   uint64_t future_use3;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FrameHeader) == 32);
+
+// CRC32C (Castagnoli) of the frame data. Verifying must not slow down
+// playback, so we use the CRC instructions of ARMv8 or SSE4.2 if the CPU
+// we run on has them, even if we're not compiled for them: the stock
+// 32-bit Raspberry Pi OS build targets ARMv6. Others (e.g. Pi1/Zero) use
+// slice-by-8 tables.
+static uint32_t (*CreateCrc32cTables())[256] {
+  uint32_t (*table)[256] = new uint32_t[8][256];
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+    table[0][i] = crc;
+  }
+  // table[k][i]: CRC of byte i followed by k zero bytes.
+  for (int k = 1; k < 8; ++k) {
+    for (int i = 0; i < 256; ++i) {
+      const uint32_t prev = table[k - 1][i];
+      table[k][i] = (prev >> 8) ^ table[0][prev & 0xff];
+    }
+  }
+  return table;
+}
+
+// Processes 8 bytes per step; streams are little-endian (see above).
+static uint32_t Crc32cSoftware(uint32_t crc, const char *data, size_t len) {
+  static const uint32_t (*const table)[256] = CreateCrc32cTables();
+  for (/**/; len >= 8; data += 8, len -= 8) {
+    uint32_t low, high;
+    memcpy(&low, data, sizeof(low));
+    memcpy(&high, data + 4, sizeof(high));
+    low ^= crc;
+    crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff]
+      ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24]
+      ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff]
+      ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+  }
+  for (/**/; len > 0; ++data, --len) {
+    crc = table[0][(crc ^ (uint8_t)*data) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define CRC32C_HARDWARE_TARGET __attribute__((target("sse4.2")))
+#elif defined(__aarch64__)
+#  define CRC32C_HARDWARE_TARGET __attribute__((target("+crc")))
+#elif defined(__arm__)
+#  define CRC32C_HARDWARE_TARGET __attribute__((target("arch=armv8-a+crc")))
+#endif
+
+#ifdef CRC32C_HARDWARE_TARGET
+static bool HasCrc32cInstructions() {
+#  if defined(__x86_64__) || defined(__i386__)
+  return __builtin_cpu_supports("sse4.2");
+#  elif defined(__aarch64__)
+  return getauxval(AT_HWCAP) & (1 << 7);    // HWCAP_CRC32
+#  else
+  return getauxval(AT_HWCAP2) & (1 << 4);   // HWCAP2_CRC32
+#  endif
+}
+
+// Only called if HasCrc32cInstructions(). The instructions are written
+// as inline assembly on ARM, as <arm_acle.h> only provides them if the
+// whole file is compiled for ARMv8.
+CRC32C_HARDWARE_TARGET
+static uint32_t Crc32cHardware(uint32_t crc, const char *data, size_t len) {
+  for (/**/; len >= sizeof(uint64_t); data += sizeof(uint64_t),
+         len -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+#  if defined(__x86_64__)
+    crc = _mm_crc32_u64(crc, word);
+#  elif defined(__i386__)
+    crc = _mm_crc32_u32(crc, (uint32_t)word);
+    crc = _mm_crc32_u32(crc, (uint32_t)(word >> 32));
+#  elif defined(__aarch64__)
+    asm("crc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(word));
+#  else
+    asm("crc32cw %0, %0, %1" : "+r"(crc) : "r"((uint32_t)word));
+    asm("crc32cw %0, %0, %1" : "+r"(crc) : "r"((uint32_t)(word >> 32)));
+#  endif
+  }
+  for (/**/; len > 0; ++data, --len) {
+    const uint32_t byte = (uint8_t)*data;
+#  if defined(__x86_64__) || defined(__i386__)
+    crc = _mm_crc32_u8(crc, byte);
+#  elif defined(__aarch64__)
+    asm("crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"(byte));
+#  else
+    asm("crc32cb %0, %0, %1" : "+r"(crc) : "r"(byte));
+#  endif
+  }
+  return crc;
+}
+#endif
+
+static uint32_t Crc32c(const char *data, size_t len) {
+#ifdef CRC32C_HARDWARE_TARGET
+  static const bool has_instructions = HasCrc32cInstructions();
+  if (has_instructions)
+    return ~Crc32cHardware(~0u, data, len);
+#endif
+  return ~Crc32cSoftware(~0u, data, len);
+}
+
+static uint64_t GetWallClockMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 }
 
 FileStreamIO::FileStreamIO(int fd) : fd_(fd) {
@@ -77,7 +204,8 @@ ssize_t MemStreamIO::Append(const void *buf, size_t count) {
   return count;
 }
 
-MemMapViewInput::MemMapViewInput(int fd) : buffer_(nullptr) {
+MemMapViewInput::MemMapViewInput(int fd)
+  : buffer_(nullptr), end_(nullptr), pos_(nullptr) {
   struct stat s;
   if (fstat(fd, &s) < 0) {
     close(fd);
@@ -86,12 +214,13 @@ MemMapViewInput::MemMapViewInput(int fd) : buffer_(nullptr) {
   }
 
   const size_t file_size = s.st_size;
-  buffer_ = (char*)mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
   close(fd);
-  if (buffer_ == MAP_FAILED) {
+  if (mapped == MAP_FAILED) {
     perror("Can't mmmap()");
     return;
   }
+  buffer_ = pos_ = (char*)mapped;
   end_ = buffer_ + file_size;
 #ifdef POSIX_MADV_WILLNEED
   // Trigger read-ahead if possible.
@@ -101,7 +230,7 @@ MemMapViewInput::MemMapViewInput(int fd) : buffer_(nullptr) {
 
 void MemMapViewInput::Rewind() { pos_ = buffer_; }
 ssize_t MemMapViewInput::Read(void *buf, size_t count) {
-  if (pos_ + count >= end_) return -1;
+  count = std::min(count, (size_t)(end_ - pos_));
   memcpy(buf, pos_, count);
   pos_ += count;
   return count;
@@ -111,6 +240,239 @@ MemMapViewInput::~MemMapViewInput() {
   if (buffer_) munmap(buffer_, end_ - buffer_);
 }
 
+SocketStreamIO::SocketStreamIO(int fd, const FrameCanvas &frame)
+  : fd_(fd), connected_(true), file_header_pos_(0), frame_size_(0),
+    has_latest_frame_(false), frame_pos_(0) {
+  memset(&stats_, 0, sizeof(stats_));
+  const char *data;
+  frame.Serialize(&data, &frame_size_);
+  frame_size_ += sizeof(FrameHeader);
+  fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+}
+SocketStreamIO::~SocketStreamIO() { close(fd_); }
+
+// Create a socket for "address"; either a Unix-domain socket path or
+// host:port. If "listening", waits for a connection and returns that.
+static int OpenSocket(const char *address, bool listening) {
+  int fd = -1;
+  if (strchr(address, '/') != NULL) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", address);
+      return -1;
+    }
+    strncpy(addr.sun_path, address, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (listening) {
+      unlink(address);
+      if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(address);
+        close(fd);
+        return -1;
+      }
+    } else if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      perror(address);
+      close(fd);
+      return -1;
+    }
+  } else {
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL) {
+      fprintf(stderr, "Expected socket path or host:port, got '%s'\n",
+              address);
+      return -1;
+    }
+    const std::string host(address, colon - address);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    struct addrinfo *addresses;
+    const int err = getaddrinfo(host.empty() ? NULL : host.c_str(), colon + 1,
+                                &hints, &addresses);
+    if (err != 0) {
+      fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+      return -1;
+    }
+    for (struct addrinfo *a = addresses; a != NULL; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd < 0) continue;
+      if (listening) {
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+      } else if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+      fprintf(stderr, "Can't %s %s\n", listening ? "listen on" : "connect to",
+              address);
+      return -1;
+    }
+  }
+
+  if (listening) {
+    const int listen_fd = fd;
+    fd = (listen(listen_fd, 1) == 0) ? accept(listen_fd, NULL, NULL) : -1;
+    if (fd < 0) perror("accept()");
+    close(listen_fd);
+    if (fd < 0) return -1;
+  }
+
+  // Frames are large, but the last packet of each should not be delayed.
+  const int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));  // TCP only.
+  return fd;
+}
+
+SocketStreamIO *SocketStreamIO::Connect(const char *address,
+                                        const FrameCanvas &frame) {
+  const int fd = OpenSocket(address, false);
+  return fd < 0 ? NULL : new SocketStreamIO(fd, frame);
+}
+
+SocketStreamIO *SocketStreamIO::Accept(const char *address,
+                                       const FrameCanvas &frame) {
+  const int fd = OpenSocket(address, true);
+  return fd < 0 ? NULL : new SocketStreamIO(fd, frame);
+}
+
+void SocketStreamIO::Rewind() { file_header_pos_ = 0; }
+
+// Stop talking to a peer that sends something we can't use.
+void SocketStreamIO::Disconnect() {
+  connected_ = false;
+  shutdown(fd_, SHUT_RDWR);
+  received_.clear();
+}
+
+// Drain everything currently available from the connection. We never
+// buffer more than the stream header and two frames; the rest stays with
+// the kernel until we are done handing out the current frame.
+bool SocketStreamIO::ReceiveAvailable() {
+  const size_t max_buffered = sizeof(FileHeader) + 2 * frame_size_;
+  char buffer[16384];
+  while (connected_) {
+    if (received_.size() >= max_buffered) {
+      ExtractLatestFrame();
+      if (received_.size() >= max_buffered) return connected_;
+    }
+    const ssize_t r = read(fd_, buffer, sizeof(buffer));
+    if (r > 0) {
+      received_.append(buffer, r);
+      if (file_header_.empty()) ExtractLatestFrame();  // Check it early.
+      continue;
+    }
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    connected_ = false;  // EOF or error.
+  }
+  return false;
+}
+
+// Parse what we received: keep the stream header, then only keep the most
+// recent complete frame, dropping the ones before. A stream that does not
+// match the frame size we expect is rejected before buffering its frames.
+void SocketStreamIO::ExtractLatestFrame() {
+  if (!connected_) return;
+  size_t pos = 0;
+  if (file_header_.empty()) {
+    if (received_.size() < sizeof(FileHeader)) return;
+    FileHeader header;
+    memcpy(&header, received_.data(), sizeof(header));
+    if (header.magic != kFileMagicValue) {
+      fprintf(stderr, "Not a content stream; closing connection.\n");
+      Disconnect();
+      return;
+    }
+    if (sizeof(FrameHeader) + header.buf_size != frame_size_) {
+      fprintf(stderr, "Stream frames have %u bytes, but %d bytes expected; "
+              "closing connection. Please use the same settings on both "
+              "ends.\n", header.buf_size,
+              (int)(frame_size_ - sizeof(FrameHeader)));
+      Disconnect();
+      return;
+    }
+    file_header_.assign(received_, 0, sizeof(header));
+    pos = sizeof(header);
+  }
+  // Don't replace the frame we're in the middle of handing out.
+  const size_t complete = (received_.size() - pos) / frame_size_;
+  if (complete > 0 && frame_pos_ == 0) {
+    // Dropped frames are checked as well; anything else would silently
+    // re-frame a stream that lost sync.
+    for (size_t i = 0; i < complete; ++i) {
+      FrameHeader h;
+      memcpy(&h, received_.data() + pos + i * frame_size_, sizeof(h));
+      if (h.magic != kFrameMagicValue
+          || sizeof(FrameHeader) + h.size != frame_size_) {
+        fprintf(stderr, "Stream out of sync; closing connection.\n");
+        Disconnect();
+        return;
+      }
+    }
+    stats_.frames_received += complete;
+    stats_.frames_dropped += complete - 1 + (has_latest_frame_ ? 1 : 0);
+    latest_frame_.assign(received_, pos + (complete - 1) * frame_size_,
+                         frame_size_);
+    has_latest_frame_ = true;
+    pos += complete * frame_size_;
+  }
+  received_.erase(0, pos);
+}
+
+ssize_t SocketStreamIO::Read(void *buf, size_t count) {
+  ReceiveAvailable();
+  ExtractLatestFrame();
+
+  if (file_header_pos_ < file_header_.size()) {
+    const size_t amount = std::min(count,
+                                   file_header_.size() - file_header_pos_);
+    memcpy(buf, file_header_.data() + file_header_pos_, amount);
+    file_header_pos_ += amount;
+    return amount;
+  }
+  if (!has_latest_frame_ || file_header_.empty())
+    return 0;  // Nothing new (yet).
+
+  if (frame_pos_ == 0) {
+    FrameHeader h;
+    memcpy(&h, latest_frame_.data(), sizeof(h));
+    if (h.timestamp_us != 0) {
+      const uint64_t now = GetWallClockMicros();
+      stats_.last_latency_us = (now > h.timestamp_us)
+        ? std::min(now - h.timestamp_us, (uint64_t)UINT32_MAX) : 0;
+      stats_.max_latency_us = std::max(stats_.max_latency_us,
+                                       stats_.last_latency_us);
+    }
+  }
+  const size_t amount = std::min(count, frame_size_ - frame_pos_);
+  memcpy(buf, latest_frame_.data() + frame_pos_, amount);
+  frame_pos_ += amount;
+  if (frame_pos_ == frame_size_) {
+    has_latest_frame_ = false;
+    frame_pos_ = 0;
+  }
+  return amount;
+}
+
+ssize_t SocketStreamIO::Append(const void *buf, size_t count) {
+  for (;;) {
+    const ssize_t w = write(fd_, buf, count);
+    if (w >= 0) return w;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    struct pollfd p = { fd_, POLLOUT, 0 };
+    poll(&p, 1, -1);
+  }
+}
+
 // Read exactly count bytes including retries. Returns success.
 static bool FullRead(StreamIO *io, void *buf, const size_t count) {
   int remaining = count;
@@ -136,7 +498,34 @@ static bool FullAppend(StreamIO *io, const void *buf, const size_t count) {
   return remaining == 0;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
+// Cheap hash over the serialized frame to quickly tell apart frames that
+// changed. Processes 64 bit at a time; frames are always multiple of that
+// in practice, but we deal with a remaining tail nevertheless.
+static uint64_t FrameHash(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const char *const end = data + len;
+  for (/**/; data + sizeof(uint64_t) <= end; data += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    h = (h ^ word) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for (/**/; data < end; ++data) {
+    h = (h ^ (uint8_t)*data) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+StreamWriter::StreamWriter(StreamIO *io, bool fold_duplicate_frames)
+  : io_(io), fold_duplicate_frames_(fold_duplicate_frames),
+    header_written_(false), pending_frame_(NULL), pending_len_(0),
+    pending_hash_(0), pending_hold_time_us_(0), has_pending_(false) {}
+
+StreamWriter::~StreamWriter() {
+  Flush();
+  delete [] pending_frame_;
+}
+
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   const char *data;
   size_t len;
@@ -145,12 +534,47 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   if (!header_written_) {
     WriteFileHeader(frame, len);
   }
+  if (!fold_duplicate_frames_) {
+    return WriteFrame(data, len, hold_time_us);
+  }
+
+  const uint64_t hash = FrameHash(data, len);
+  if (has_pending_ && hash == pending_hash_ && len == pending_len_
+      && (uint64_t)pending_hold_time_us_ + hold_time_us <= UINT32_MAX
+      && memcmp(data, pending_frame_, len) == 0) {
+    pending_hold_time_us_ += hold_time_us;
+    return true;
+  }
+
+  const bool success = Flush();
+  if (pending_frame_ == NULL || len != pending_len_) {
+    delete [] pending_frame_;
+    pending_frame_ = new char [ len ];
+  }
+  memcpy(pending_frame_, data, len);
+  pending_len_ = len;
+  pending_hash_ = hash;
+  pending_hold_time_us_ = hold_time_us;
+  has_pending_ = true;
+  return success;
+}
+
+bool StreamWriter::Flush() {
+  if (!has_pending_) return true;
+  has_pending_ = false;
+  return WriteFrame(pending_frame_, pending_len_, pending_hold_time_us_);
+}
+
+bool StreamWriter::WriteFrame(const char *data, size_t len,
+                              uint32_t hold_time_us) {
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
   h.size = len;
   h.hold_time_us = hold_time_us;
+  h.crc32c = Crc32c(data, len);
+  h.timestamp_us = GetWallClockMicros();
   FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  return FullAppend(io_, data, len);
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
@@ -159,13 +583,16 @@ void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
   header.width = frame.width();
   header.height = frame.height();
   header.buf_size = len;
+  header.pwm_bits = frame.pwmbits();
   header.is_wide_gpio = (sizeof(gpio_bits_t) > 4);
+  header.has_frame_checksums = true;
   FullAppend(io_, &header, sizeof(header));
   header_written_ = true;
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), header_frame_buffer_(NULL) {
+  : io_(io), pwm_bits_(0), has_checksums_(false), verify_checksums_(true),
+    corrupt_frames_(0), state_(STREAM_AT_BEGIN), header_frame_buffer_(NULL) {
   io_->Rewind();
 }
 StreamReader::~StreamReader() { delete [] header_frame_buffer_; }
@@ -179,13 +606,21 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
   if (state_ == STREAM_AT_BEGIN && !ReadFileHeader(*frame)) return false;
   if (state_ != STREAM_READING) return false;
 
-  // Read header and expected buffer size.
-  if (!FullRead(io_, header_frame_buffer_,
-                sizeof(FrameHeader) + frame_buf_size_)) {
-    return false;
-  }
-
   const FrameHeader &h = *reinterpret_cast<FrameHeader*>(header_frame_buffer_);
+  const char *const frame_data = header_frame_buffer_ + sizeof(FrameHeader);
+  for (;;) {
+    // Read header and expected buffer size.
+    if (!FullRead(io_, header_frame_buffer_,
+                  sizeof(FrameHeader) + frame_buf_size_)) {
+      return false;
+    }
+    // Corrupt frames (e.g. bad SD-card block) are skipped.
+    if (!has_checksums_ || !verify_checksums_ || h.magic != kFrameMagicValue
+        || h.crc32c == Crc32c(frame_data, frame_buf_size_)) {
+      break;
+    }
+    ++corrupt_frames_;
+  }
 
   // TODO: we might allow for this to be a kFileMagicValue, to allow people
   // to just concatenate streams. In that case, we just would need to read
@@ -202,13 +637,13 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
     return false;
 
   if (hold_time_us) *hold_time_us = h.hold_time_us;
-  return frame->Deserialize(header_frame_buffer_ + sizeof(FrameHeader),
-                            frame_buf_size_);
+  return frame->Deserialize(frame_data, frame_buf_size_);
 }
 
 bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
   FileHeader header;
-  FullRead(io_, &header, sizeof(header));
+  if (!FullRead(io_, &header, sizeof(header)))
+    return false;  // Not available yet, e.g. live stream. Try again later.
   if (header.magic != kFileMagicValue) {
     state_ = STREAM_ERROR;
     return false;
@@ -221,6 +656,16 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
     state_ = STREAM_ERROR;
     return false;
   }
+  const char *data;
+  size_t len;
+  frame.Serialize(&data, &len);
+  if (header.buf_size != len) {
+    fprintf(stderr, "This stream has frames of %u bytes, but %d bytes "
+            "expected. Please use the same settings for record/replay\n",
+            header.buf_size, (int)len);
+    state_ = STREAM_ERROR;
+    return false;
+  }
   if (header.is_wide_gpio != (sizeof(gpio_bits_t) == 8)) {
     fprintf(stderr, "This stream was written with %s GPIO width support but "
             "this library is compiled with %d bit GPIO width (see "
@@ -231,9 +676,37 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
     return false;
   }
   state_ = STREAM_READING;
+  pwm_bits_ = header.pwm_bits;
+  has_checksums_ = header.has_frame_checksums;
   frame_buf_size_ = header.buf_size;
   if (!header_frame_buffer_)
     header_frame_buffer_ = new char [ sizeof(FrameHeader) + header.buf_size ];
   return true;
 }
+
+bool TranscodeStream(StreamIO *in, FrameCanvas *from,
+                     StreamIO *out, FrameCanvas *to) {
+  StreamReader reader(in);
+  StreamWriter writer(out);
+  const int width = std::min(from->width(), to->width());
+  const int height = std::min(from->height(), to->height());
+  uint32_t hold_time_us;
+  int frames = 0;
+  while (reader.GetNext(from, &hold_time_us)) {
+    if (frames++ == 0 && reader.pwm_bits() > 0) {
+      from->SetPWMBits(reader.pwm_bits());
+    }
+    to->Clear();
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        uint8_t r, g, b;
+        from->GetPixel(x, y, &r, &g, &b);
+        to->SetPixel(x, y, r, g, b);
+      }
+    }
+    if (!writer.Stream(*to, hold_time_us))
+      return false;
+  }
+  return frames > 0 && writer.Flush();
+}
 }  // namespace rgb_matrix
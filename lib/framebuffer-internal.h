@@ -18,6 +18,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <vector>
+
 #include "hardware-mapping.h"
 #include "../include/graphics.h"
 
@@ -38,14 +41,75 @@ struct PixelDesignator {
   gpio_bits_t mask;
 };
 
+// The color bits of a PixelDesignator. There are only a few of these on
+// a display (one per parallel chain and sub-panel), so the
+// PixelDesignatorMap stores them once in a table.
+struct DesignatorClass {
+  gpio_bits_t r_bit;
+  gpio_bits_t g_bit;
+  gpio_bits_t b_bit;
+  gpio_bits_t mask;
+};
+
+// A horizontal run of pixels in the visible PixelDesignatorMap that share
+// the same DesignatorClass, with evenly spaced gpio_words. Mappers such as
+// U-mapper, Rotate or Mirror mostly reverse or offset rows, so a row
+// typically consists of only a few runs that bulk writers can handle in
+// one go instead of looking up each pixel.
+struct PixelRun {
+  int x;              // First visible column of the run.
+  int length;
+  long gpio_word;     // gpio_word of the pixel at "x".
+  long stride;        // Difference in gpio_word between neighboring pixels.
+  uint32_t designator_class;  // Index or kUnusedClass.
+};
+
 class PixelDesignatorMap {
 public:
+  // Each pixel is stored in 32 bits: the gpio_word in the lower bits, the
+  // index into the DesignatorClass table in the upper bits. This keeps
+  // lookups cache-friendly on large displays.
+  typedef uint32_t Entry;
+  static constexpr int kClassBits = 6;
+  static constexpr int kWordBits = 32 - kClassBits;
+  static constexpr Entry kWordMask = (1u << kWordBits) - 1;
+  static constexpr Entry kUnusedPixel = ~0u;  // Pixel not connected.
+  static constexpr uint32_t kUnusedClass = kUnusedPixel >> kWordBits;
+
   PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
+
+  // Create a new map with all pixels unused, that shares the designator
+  // classes with "other", so that Entries can be copied from there.
+  PixelDesignatorMap(int width, int height, const PixelDesignatorMap &other);
   ~PixelDesignatorMap();
 
-  // Get a writable version of the PixelDesignator. Outside Framebuffer used
+  // Get a writable version of the Entry. Outside Framebuffer used
   // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
-  PixelDesignator *get(int x, int y);
+  inline Entry *get(int x, int y) {
+    if (x < 0 || y < 0 || x >= width_ || y >= height_)
+      return NULL;
+    return buffer_ + (y*width_) + x;
+  }
+
+  static inline long gpio_word(Entry e) { return e & kWordMask; }
+  inline const DesignatorClass &designator_class(Entry e) const {
+    return classes_[e >> kWordBits];
+  }
+
+  inline const DesignatorClass &designator_class_at(uint32_t index) const {
+    return classes_[index];
+  }
+
+  // Set pixel to the given designator.
+  void Set(int x, int y, const PixelDesignator &designator);
+
+  // Recalculate the PixelRuns. Needs to be called after all Entries are
+  // set, before using runs_begin()/runs_end().
+  void UpdateRuns();
+
+  // Runs covering row "y" from left to right. "y" needs to be in range.
+  const PixelRun *runs_begin(int y) const { return &runs_[row_runs_[y]]; }
+  const PixelRun *runs_end(int y) const { return &runs_[row_runs_[y+1]]; }
 
   inline int width() const { return width_; }
   inline int height() const { return height_; }
@@ -53,11 +117,34 @@ public:
   // All bits that set red/green/blue pixels; used for Fill().
   const PixelDesignator &GetFillColorBits() { return fill_bits_; }
 
+  // Store map to file to be loaded with LoadFromFile() on next start.
+  // The "key" identifies the configuration that resulted in this map.
+  bool SaveToFile(const char *path, uint64_t key) const;
+
+  // Memory map a PixelDesignatorMap stored with SaveToFile(). Returns NULL
+  // if the file does not exist or does not match "key". All gpio_words
+  // need to be below "gpio_word_limit" for the file to be considered valid.
+  static PixelDesignatorMap *LoadFromFile(const char *path, uint64_t key,
+                                          long gpio_word_limit);
+
 private:
+  PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits,
+                     Entry *mapped_buffer,
+                     void *mapped_file, size_t mapped_size);
+
   const int width_;
   const int height_;
   const PixelDesignator fill_bits_;  // Precalculated for fill.
-  PixelDesignator *const buffer_;
+  Entry *const buffer_;
+  void *const mapped_file_;   // Non-NULL if buffer_ is in a mapped file.
+  const size_t mapped_size_;
+
+  // The last possible class index is reserved for kUnusedPixel.
+  DesignatorClass classes_[(1 << kClassBits) - 1];
+  int num_classes_;
+
+  std::vector<PixelRun> runs_;
+  std::vector<int> row_runs_;  // Index of the first run for each row.
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -99,11 +186,15 @@ public:
                        int row_address_type);
   static void InitializePanels(GPIO *io, const char *panel_type, int columns);
 
+  // Upper limit of PixelDesignator::gpio_word in a Framebuffer of the given
+  // size. Used to validate externally stored PixelDesignatorMaps.
+  static long GpioWordLimit(int rows, int columns);
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
   // Returns boolean to signify if value was within range.
   bool SetPWMBits(uint8_t value);
-  uint8_t pwmbits() { return pwm_bits_; }
+  uint8_t pwmbits() const { return pwm_bits_; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
   void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
@@ -116,6 +207,16 @@ public:
   }
   uint8_t brightness() { return brightness_; }
 
+  // Scale the output of all Framebuffers in percent (1..100) by shortening
+  // the output-enable pulses in DumpToMatrix().
+  static void SetOutputBrightness(uint8_t percent);
+  static uint8_t output_brightness() { return output_brightness_; }
+
+  // Columns to rotate the output by in DumpToMatrix(). Can be changed
+  // while this Framebuffer is shown.
+  void SetScrollOffset(int offset);
+  int scroll_offset() const { return scroll_offset_; }
+
   void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
 
   void Serialize(const char **data, size_t *len) const;
@@ -128,12 +229,18 @@ public:
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   void SetPixels(int x, int y, int width, int height, Color *colors);
+  void GetPixel(int x, int y, uint8_t *red, uint8_t *green, uint8_t *blue);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
 private:
   static const struct HardwareMapping *hardware_mapping_;
   static RowAddressSetter *row_setter_;
+  static std::atomic<uint8_t> output_brightness_;
+
+  // For each output brightness, the lowest bitplane with a pulse long
+  // enough to be shown.
+  static int min_bitplane_for_brightness_[101];
 
   // This returns the gpio-bit for given color (one of 'R', 'G', 'B'). This is
   // returning the right value in case "led_sequence" is _not_ "RGB"
@@ -144,8 +251,12 @@ private:
 
   void InitDefaultDesignator(int x, int y, const char *led_sequence,
                              PixelDesignator *designator);
+  void SetRun(long gpio_word, long stride, const DesignatorClass &designator,
+              const Color *colors, int count);
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+  inline uint16_t MapColor(uint8_t c) const;
+  uint8_t UnmapColor(uint16_t value, uint16_t plane_mask) const;
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -157,6 +268,7 @@ private:
   uint8_t pwm_bits_;   // PWM bits to display.
   bool do_luminance_correct_;
   uint8_t brightness_;
+  std::atomic<int> scroll_offset_;  // 0 <= offset < columns_
 
   const int double_rows_;
   const size_t buffer_size_;
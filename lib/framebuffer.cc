@@ -21,11 +21,17 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
 
 #include <algorithm>
 
@@ -44,20 +50,204 @@ static PinPulser *sOutputEnablePulser = NULL;
 #  define SUB_PANELS_ 2
 #endif
 
-PixelDesignator *PixelDesignatorMap::get(int x, int y) {
-  if (x < 0 || y < 0 || x >= width_ || y >= height_)
-    return NULL;
-  return buffer_ + (y*width_) + x;
+PixelDesignatorMap::PixelDesignatorMap(int width, int height,
+                                       const PixelDesignator &fill_bits)
+  : width_(width), height_(height), fill_bits_(fill_bits),
+    buffer_(new Entry[width * height]),
+    mapped_file_(NULL), mapped_size_(0), num_classes_(0) {
+  std::fill(buffer_, buffer_ + width * height, kUnusedPixel);
 }
 
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
-                                       const PixelDesignator &fill_bits)
+                                       const PixelDesignatorMap &other)
+  : width_(width), height_(height), fill_bits_(other.fill_bits_),
+    buffer_(new Entry[width * height]),
+    mapped_file_(NULL), mapped_size_(0), num_classes_(other.num_classes_) {
+  std::fill(buffer_, buffer_ + width * height, kUnusedPixel);
+  std::copy(other.classes_, other.classes_ + num_classes_, classes_);
+}
+
+PixelDesignatorMap::PixelDesignatorMap(int width, int height,
+                                       const PixelDesignator &fill_bits,
+                                       Entry *mapped_buffer,
+                                       void *mapped_file, size_t mapped_size)
   : width_(width), height_(height), fill_bits_(fill_bits),
-    buffer_(new PixelDesignator[width * height]) {
+    buffer_(mapped_buffer),
+    mapped_file_(mapped_file), mapped_size_(mapped_size), num_classes_(0) {
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
-  delete [] buffer_;
+  if (mapped_file_)
+    munmap(mapped_file_, mapped_size_);
+  else
+    delete [] buffer_;
+}
+
+void PixelDesignatorMap::Set(int x, int y, const PixelDesignator &d) {
+  Entry *entry = get(x, y);
+  if (entry == NULL) return;
+  if (d.gpio_word < 0) {
+    *entry = kUnusedPixel;
+    return;
+  }
+  int c;
+  for (c = 0; c < num_classes_; ++c) {
+    const DesignatorClass &existing = classes_[c];
+    if (existing.r_bit == d.r_bit && existing.g_bit == d.g_bit
+        && existing.b_bit == d.b_bit && existing.mask == d.mask)
+      break;
+  }
+  if (c == num_classes_) {
+    if (num_classes_ == (int) (sizeof(classes_) / sizeof(classes_[0]))) {
+      fprintf(stderr, "Too many distinct pixel designators.\n");
+      abort();
+    }
+    DesignatorClass &added = classes_[num_classes_++];
+    added.r_bit = d.r_bit;
+    added.g_bit = d.g_bit;
+    added.b_bit = d.b_bit;
+    added.mask = d.mask;
+  }
+  if (d.gpio_word >= (long) kWordMask) {
+    fprintf(stderr, "Framebuffer too large for pixel mapping.\n");
+    abort();
+  }
+  *entry = ((Entry) c << kWordBits) | (Entry) d.gpio_word;
+}
+
+void PixelDesignatorMap::UpdateRuns() {
+  runs_.clear();
+  row_runs_.resize(height_ + 1);
+  for (int y = 0; y < height_; ++y) {
+    row_runs_[y] = runs_.size();
+    const Entry *row = buffer_ + y * width_;
+    for (int x = 0; x < width_; /**/) {
+      PixelRun run;
+      run.x = x;
+      run.length = 1;
+      run.designator_class = row[x] >> kWordBits;
+      run.gpio_word = gpio_word(row[x]);
+      run.stride = 0;
+      if (row[x] == kUnusedPixel) {
+        while (x + run.length < width_ && row[x + run.length] == kUnusedPixel)
+          ++run.length;
+      } else {
+        if (x + 1 < width_ && row[x + 1] != kUnusedPixel
+            && (row[x + 1] >> kWordBits) == run.designator_class) {
+          run.stride = gpio_word(row[x + 1]) - run.gpio_word;
+        }
+        while (x + run.length < width_) {
+          const Entry next = row[x + run.length];
+          if (next == kUnusedPixel
+              || (next >> kWordBits) != run.designator_class
+              || gpio_word(next) != run.gpio_word + run.length * run.stride)
+            break;
+          ++run.length;
+        }
+      }
+      runs_.push_back(run);
+      x += run.length;
+    }
+  }
+  row_runs_[height_] = runs_.size();
+}
+
+namespace {
+// The cache file is the header, followed by the designator class table and
+// the entries. The entries are used as-is when memory mapped.
+static const uint32_t kPixelMapFileMagic = 0x50584D32;
+struct PixelMapFileHeader {
+  uint32_t magic;
+  uint32_t class_size;  // GPIO width dependent.
+  uint64_t key;
+  int32_t width;
+  int32_t height;
+  int32_t num_classes;
+  int32_t reserved;
+  PixelDesignator fill_bits;
+};
+}
+
+bool PixelDesignatorMap::SaveToFile(const char *path, uint64_t key) const {
+  PixelMapFileHeader header;
+  header.magic = kPixelMapFileMagic;
+  header.class_size = sizeof(DesignatorClass);
+  header.key = key;
+  header.width = width_;
+  header.height = height_;
+  header.num_classes = num_classes_;
+  header.reserved = 0;
+  header.fill_bits = fill_bits_;
+
+  // Write to a temporary file first, so that we never leave a partial
+  // file behind if we're interrupted.
+  const std::string tmp_path = std::string(path) + ".tmp";
+  FILE *out = fopen(tmp_path.c_str(), "wb");
+  if (out == NULL) return false;
+  bool success = (fwrite(&header, sizeof(header), 1, out) == 1);
+  success &= (fwrite(classes_, sizeof(DesignatorClass), num_classes_, out)
+              == (size_t)num_classes_);
+  success &= (fwrite(buffer_, sizeof(Entry), width_ * height_, out)
+              == (size_t)(width_ * height_));
+  success &= (fclose(out) == 0);
+  if (success && rename(tmp_path.c_str(), path) == 0)
+    return true;
+  unlink(tmp_path.c_str());
+  return false;
+}
+
+PixelDesignatorMap *PixelDesignatorMap::LoadFromFile(const char *path,
+                                                     uint64_t key,
+                                                     long gpio_word_limit) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat s;
+  if (fstat(fd, &s) < 0 || s.st_size < (off_t)sizeof(PixelMapFileHeader)) {
+    close(fd);
+    return NULL;
+  }
+  const size_t file_size = s.st_size;
+  // Private writable mapping: users still can modify the entries, without
+  // it affecting the file.
+  void *mapped = mmap(NULL, file_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                      fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return NULL;
+
+  const PixelMapFileHeader *header = (const PixelMapFileHeader*) mapped;
+  const int max_classes = (1 << kClassBits) - 1;
+  bool valid = (header->magic == kPixelMapFileMagic
+                && header->class_size == sizeof(DesignatorClass)
+                && header->key == key
+                && header->width > 0 && header->height > 0
+                && header->num_classes >= 0
+                && header->num_classes <= max_classes
+                && file_size == sizeof(PixelMapFileHeader)
+                + header->num_classes * sizeof(DesignatorClass)
+                + (size_t)header->width * header->height * sizeof(Entry));
+
+  // A broken file would make us write outside the framebuffer.
+  const DesignatorClass *const classes = (DesignatorClass*) (header + 1);
+  Entry *const entries = valid
+    ? (Entry*) (classes + header->num_classes)
+    : NULL;
+  for (int i = 0; valid && i < header->width * header->height; ++i) {
+    const Entry e = entries[i];
+    valid = (e == kUnusedPixel
+             || ((int)(e >> kWordBits) < header->num_classes
+                 && gpio_word(e) < gpio_word_limit));
+  }
+  if (!valid) {
+    munmap(mapped, file_size);
+    return NULL;
+  }
+  PixelDesignatorMap *result
+    = new PixelDesignatorMap(header->width, header->height,
+                             header->fill_bits, entries, mapped, file_size);
+  std::copy(classes, classes + header->num_classes, result->classes_);
+  result->num_classes_ = header->num_classes;
+  result->UpdateRuns();
+  return result;
 }
 
 // Different panel types use different techniques to set the row address.
@@ -283,6 +473,8 @@ private:
 
 const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
 RowAddressSetter *Framebuffer::row_setter_ = NULL;
+std::atomic<uint8_t> Framebuffer::output_brightness_(100);
+int Framebuffer::min_bitplane_for_brightness_[101];
 
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
                          int scan_mode,
@@ -295,6 +487,7 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     scan_mode_(scan_mode),
     inverse_color_(inverse_color),
     pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    scroll_offset_(0),
     double_rows_(rows / SUB_PANELS_),
     buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
     shared_mapper_(mapper) {
@@ -333,11 +526,14 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     fill_bits.b_bit = GetGpioFromLedSequence('B', led_sequence, r, g, b);
 
     *shared_mapper_ = new PixelDesignatorMap(columns_, height_, fill_bits);
+    PixelDesignator designator;
     for (int y = 0; y < height_; ++y) {
       for (int x = 0; x < columns_; ++x) {
-        InitDefaultDesignator(x, y, led_sequence, (*shared_mapper_)->get(x, y));
+        InitDefaultDesignator(x, y, led_sequence, &designator);
+        (*shared_mapper_)->Set(x, y, designator);
       }
     }
+    (*shared_mapper_)->UpdateRuns();
   }
 
   Clear();
@@ -454,12 +650,48 @@ Framebuffer::~Framebuffer() {
                                              is_some_adafruit_hat);
   assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
 
-  std::vector<int> bitplane_timings;
+  std::vector<int> full_timings;
   uint32_t timing_ns = pwm_lsb_nanoseconds;
   for (int b = 0; b < kBitPlanes; ++b) {
-    bitplane_timings.push_back(timing_ns);
+    full_timings.push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
+
+  // A set of kBitPlanes timings for each output brightness, starting with
+  // 100%, each scaled down. The hardware pulser works in ticks of half the
+  // lsb time, so all timings are multiples of that. To keep the ratio
+  // between bitplanes (and with it the colors), all shown planes are scaled
+  // by the same factor. The lowest planes are dropped until the shortest
+  // remaining pulse is at least the lsb time and its rounding to ticks
+  // keeps the brightness within about 6%.
+  std::vector<int> bitplane_timings;
+  for (int percent = 100; percent >= 1; --percent) {
+    int min_bitplane = kBitPlanes - 1;
+    int64_t min_ticks = 2;
+    for (int b = 0; b < kBitPlanes; ++b) {
+      const int64_t ticks = 2 * full_timings[b] / pwm_lsb_nanoseconds;
+      const int64_t scaled = (ticks * percent + 50) / 100;
+      if (scaled >= 2
+          && 16 * std::abs(scaled * 100 - ticks * percent) <= ticks * percent) {
+        min_bitplane = b;
+        min_ticks = scaled;
+        break;
+      }
+    }
+    min_bitplane_for_brightness_[percent] = min_bitplane;
+    const int64_t min_plane_ticks
+      = 2 * full_timings[min_bitplane] / pwm_lsb_nanoseconds;
+    for (int b = 0; b < kBitPlanes; ++b) {
+      if (b < min_bitplane) {
+        bitplane_timings.push_back(pwm_lsb_nanoseconds);  // Not shown.
+        continue;
+      }
+      // Higher planes are a multiple of the lowest one.
+      const int64_t ticks = min_ticks
+        * (2 * full_timings[b] / pwm_lsb_nanoseconds) / min_plane_ticks;
+      bitplane_timings.push_back((ticks * pwm_lsb_nanoseconds + 1) / 2);
+    }
+  }
   sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
                                           allow_hardware_pulsing,
                                           bitplane_timings);
@@ -566,6 +798,12 @@ static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
   }
 }
 
+/*static*/ long Framebuffer::GpioWordLimit(int rows, int columns) {
+  // SetPixel() writes all bitplanes, starting at the gpio_word.
+  const int double_rows = rows / SUB_PANELS_;
+  return (long)double_rows * columns * kBitPlanes - columns * (kBitPlanes - 1);
+}
+
 bool Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
@@ -623,6 +861,32 @@ static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
+inline uint16_t Framebuffer::MapColor(uint8_t c) const {
+  return do_luminance_correct_
+    ? CIEMapColor(brightness_, c)
+    : DirectMapColor(brightness_, c);
+}
+
+// Inverse of MapColor(): find the smallest 8-bit value that is stored the
+// same way in the bitplanes given by "plane_mask", or the closest if none.
+uint8_t Framebuffer::UnmapColor(uint16_t value, uint16_t plane_mask) const {
+  // MapColor() is monotonic, so we can do a binary search.
+  int lo = 0, hi = 255;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if ((MapColor(mid) & plane_mask) < value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0 && (MapColor(lo) & plane_mask) != value) {
+    const int above = (MapColor(lo) & plane_mask) - value;
+    const int below = value - (MapColor(lo - 1) & plane_mask);
+    if (below < above) --lo;
+  }
+  return lo;
+}
+
 inline void Framebuffer::MapColors(
   uint8_t r, uint8_t g, uint8_t b,
   uint16_t *red, uint16_t *green, uint16_t *blue) {
@@ -669,10 +933,12 @@ int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
-  if (designator == NULL) return;
-  const long pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  const PixelDesignatorMap::Entry *entry = (*shared_mapper_)->get(x, y);
+  if (entry == NULL) return;
+  if (*entry == PixelDesignatorMap::kUnusedPixel) return;
+  const long pos = PixelDesignatorMap::gpio_word(*entry);
+  const DesignatorClass *designator
+    = &(*shared_mapper_)->designator_class(*entry);
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
@@ -694,14 +960,116 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   }
 }
 
+// Write "count" pixels starting at "gpio_word", each "stride" words apart.
+// For adjacent words, we go through the bitplanes in the outer loop, so that
+// the inner loop is simple enough for the compiler to vectorize.
+void Framebuffer::SetRun(long gpio_word, long stride,
+                         const DesignatorClass &designator,
+                         const Color *colors, int count) {
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const gpio_bits_t r_bits = designator.r_bit;
+  const gpio_bits_t g_bits = designator.g_bit;
+  const gpio_bits_t b_bits = designator.b_bit;
+  const gpio_bits_t designator_mask = designator.mask;
+  if (stride != 1 && stride != -1) {
+    for (int i = 0; i < count; ++i, gpio_word += stride) {
+      uint16_t red, green, blue;
+      MapColors(colors[i].r, colors[i].g, colors[i].b, &red, &green, &blue);
+      gpio_bits_t *bits = bitplane_buffer_ + gpio_word
+        + columns_ * min_bit_plane;
+      for (int b = min_bit_plane; b < kBitPlanes; ++b, bits += columns_) {
+        gpio_bits_t color_bits = 0;
+        if (red & (1 << b))   color_bits |= r_bits;
+        if (green & (1 << b)) color_bits |= g_bits;
+        if (blue & (1 << b))  color_bits |= b_bits;
+        *bits = (*bits & designator_mask) | color_bits;
+      }
+    }
+    return;
+  }
+
+  static constexpr int kChunk = 64;
+  uint16_t red[kChunk], green[kChunk], blue[kChunk];
+  while (count > 0) {
+    const int n = std::min(count, kChunk);
+    // A reversed run is just a forward run with the colors reversed.
+    const long first_word = (stride == 1) ? gpio_word : gpio_word - (n - 1);
+    for (int i = 0; i < n; ++i) {
+      const int pos = (stride == 1) ? i : n - 1 - i;
+      MapColors(colors[i].r, colors[i].g, colors[i].b,
+                &red[pos], &green[pos], &blue[pos]);
+    }
+    gpio_bits_t *plane = bitplane_buffer_ + first_word
+      + columns_ * min_bit_plane;
+    for (int b = min_bit_plane; b < kBitPlanes; ++b, plane += columns_) {
+      for (int i = 0; i < n; ++i) {
+        const gpio_bits_t color_bits
+          = (-(gpio_bits_t)((red[i] >> b) & 1) & r_bits)
+          | (-(gpio_bits_t)((green[i] >> b) & 1) & g_bits)
+          | (-(gpio_bits_t)((blue[i] >> b) & 1) & b_bits);
+        plane[i] = (plane[i] & designator_mask) | color_bits;
+      }
+    }
+    gpio_word += n * stride;
+    colors += n;
+    count -= n;
+  }
+}
+
 void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
-  for (int iy = 0; iy < height; ++iy) {
-    for (int ix = 0; ix < width; ++ix) {
-      SetPixel(x + ix, y + iy, colors->r, colors->g, colors->b);
-      ++colors;
+  const PixelDesignatorMap &map = **shared_mapper_;
+  const int x_end = std::min(x + width, map.width());
+  const int y_end = std::min(y + height, map.height());
+  for (int iy = std::max(y, 0); iy < y_end; ++iy) {
+    const Color *row_colors = colors + (iy - y) * width;
+    int ix = std::max(x, 0);
+    for (const PixelRun *run = map.runs_begin(iy);
+         ix < x_end && run != map.runs_end(iy); ++run) {
+      const int run_end = run->x + run->length;
+      if (run_end <= ix) continue;
+      const int count = std::min(run_end, x_end) - ix;
+      if (run->designator_class != PixelDesignatorMap::kUnusedClass) {
+        SetRun(run->gpio_word + (ix - run->x) * run->stride, run->stride,
+               map.designator_class_at(run->designator_class),
+               row_colors + (ix - x), count);
+      }
+      ix += count;
     }
   }
 }
+
+void Framebuffer::GetPixel(int x, int y,
+                           uint8_t *r, uint8_t *g, uint8_t *b) {
+  *r = *g = *b = 0;
+  const PixelDesignatorMap::Entry *entry = (*shared_mapper_)->get(x, y);
+  if (entry == NULL) return;
+  if (*entry == PixelDesignatorMap::kUnusedPixel) return;
+  const long pos = PixelDesignatorMap::gpio_word(*entry);
+  const DesignatorClass *designator
+    = &(*shared_mapper_)->designator_class(*entry);
+
+  const gpio_bits_t *bits = bitplane_buffer_ + pos;
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  bits += (columns_ * min_bit_plane);
+  uint16_t red = 0, green = 0, blue = 0;
+  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
+    if (*bits & designator->r_bit) red |= mask;
+    if (*bits & designator->g_bit) green |= mask;
+    if (*bits & designator->b_bit) blue |= mask;
+    bits += columns_;
+  }
+
+  const uint16_t plane_mask = ((1 << kBitPlanes) - 1) & ~((1 << min_bit_plane) - 1);
+  if (inverse_color_) {
+    red = ~red & plane_mask;
+    green = ~green & plane_mask;
+    blue = ~blue & plane_mask;
+  }
+  *r = UnmapColor(red, plane_mask);
+  *g = UnmapColor(green, plane_mask);
+  *b = UnmapColor(blue, plane_mask);
+}
+
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
                                                 const char *led_sequence,
@@ -814,6 +1182,16 @@ bool Framebuffer::Deserialize(const char *data, size_t len) {
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  scroll_offset_ = other->scroll_offset_.load();
+}
+
+void Framebuffer::SetOutputBrightness(uint8_t percent) {
+  output_brightness_ = (percent <= 100 ? (percent != 0 ? percent : 1) : 100);
+}
+
+void Framebuffer::SetScrollOffset(int offset) {
+  offset %= columns_;
+  scroll_offset_ = (offset < 0) ? offset + columns_ : offset;
 }
 
 void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
@@ -839,7 +1217,15 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
   color_clk_mask |= h.clock;
 
   // Depending if we do dithering, we might not always show the lowest bits.
-  const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
+  // At low output brightness, the lowest bits might be too short to show.
+  const int output_brightness = output_brightness_;
+  const int start_bit = std::max(
+    std::max(pwm_low_bit, kBitPlanes - pwm_bits_),
+    min_bitplane_for_brightness_[output_brightness]);
+  const int pulse_offset = (100 - output_brightness) * kBitPlanes;
+
+  // Read once, so that the whole frame is shown with the same offset.
+  const int scroll_offset = scroll_offset_;
 
   const uint8_t half_double = double_rows_/2;
   for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
@@ -859,13 +1245,15 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
     for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+      const gpio_bits_t *const row_data = ValueAt(d_row, 0, b);
+      const gpio_bits_t *const row_end = row_data + columns_;
+      const gpio_bits_t *out = row_data + scroll_offset;
       // While the output enable is still on, we can already clock in the next
       // data.
       for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
+        io->WriteMaskedBits(*out, color_clk_mask);  // col + reset clock
         io->SetBits(h.clock);               // Rising edge: clock color in.
+        if (++out == row_end) out = row_data;  // Wrap around when scrolled.
       }
       io->ClearBits(color_clk_mask);    // clock back to normal.
 
@@ -879,7 +1267,7 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
       io->ClearBits(h.strobe);
 
       // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+      sOutputEnablePulser->SendPulse(pulse_offset + b);
     }
   }
 }
@@ -14,11 +14,15 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include "graphics.h"
+#include "led-matrix.h"
 #include "utf8-internal.h"
+#include "bitmap-internal.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <functional>
 #include <algorithm>
+#include <vector>
 
 namespace rgb_matrix {
 bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
@@ -57,6 +61,30 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
   const size_t next_row_skip = skip_start_row + skip_end_row;
   buffer += skip_start_row;
 
+  // A FrameCanvas can write whole spans at once. Rows are converted in
+  // chunks on the stack, so this doesn't allocate.
+  FrameCanvas *frame_canvas = dynamic_cast<FrameCanvas*>(c);
+  if (frame_canvas && w > canvas_offset_x) {
+    const int r = is_bgr ? 2 : 0;
+    const int b = is_bgr ? 0 : 2;
+    Color span[256];
+    for (int y = canvas_offset_y; y < h; ++y) {
+      for (int x = canvas_offset_x; x < w; ) {
+        const int n = std::min(w - x, (int)(sizeof(span) / sizeof(span[0])));
+        for (int i = 0; i < n; ++i) {
+          span[i].r = buffer[r];
+          span[i].g = buffer[1];
+          span[i].b = buffer[b];
+          buffer += 3;
+        }
+        frame_canvas->SetPixels(x, y, n, 1, span);
+        x += n;
+      }
+      buffer += next_row_skip;
+    }
+    return true;
+  }
+
   if (is_bgr) {
     for (int y = canvas_offset_y; y < h; ++y) {
       for (int x = canvas_offset_x; x < w; ++x) {
@@ -105,6 +133,179 @@ int DrawText(Canvas *c, const Font &font,
   return DrawText(c, font, x, y, color, background_color, utf8_text, 0);
 }
 
+namespace {
+// Canvas that records what DrawText() draws, in order, without any clipping.
+class RecordingCanvas : public Canvas {
+public:
+  struct Pixel {
+    int x, y;
+    bool foreground;
+  };
+
+  // Text is drawn at this origin, so that it never hits the border.
+  static constexpr int kOrigin = 1 << 24;
+
+  RecordingCanvas(const Color &foreground) : foreground_(foreground) {}
+
+  virtual int width() const { return 2 * kOrigin; }
+  virtual int height() const { return 2 * kOrigin; }
+  virtual void SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+    const Pixel p = { x, y, (r == foreground_.r && g == foreground_.g
+                             && b == foreground_.b) };
+    pixels_.push_back(p);
+  }
+  virtual void Clear() {}
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {}
+
+  const std::vector<Pixel> &pixels() const { return pixels_; }
+
+private:
+  const Color foreground_;
+  std::vector<Pixel> pixels_;
+};
+}  // namespace
+
+TextCache::TextCache(size_t memory_budget)
+  : memory_budget_(memory_budget), memory_used_(0) {}
+
+TextCache::~TextCache() {}
+
+void TextCache::Clear() {
+  index_.clear();
+  sprites_.clear();
+  memory_used_ = 0;
+}
+
+void TextCache::Render(const Font &font, const Color *background_color,
+                       const char *utf8_text, int kerning_offset,
+                       Sprite *sprite) {
+  // Any two distinct colors do; the sprite only tells them apart.
+  const Color foreground(255, 255, 255);
+  const Color background(0, 0, 0);
+  RecordingCanvas recorder(foreground);
+  const int origin = RecordingCanvas::kOrigin;
+  sprite->advance = rgb_matrix::DrawText(&recorder, font, origin, origin,
+                                         foreground,
+                                         background_color ? &background : NULL,
+                                         utf8_text, kerning_offset);
+
+  const std::vector<RecordingCanvas::Pixel> &pixels = recorder.pixels();
+  int x0 = origin, y0 = origin, x1 = origin, y1 = origin;
+  if (!pixels.empty()) {
+    x0 = x1 = pixels[0].x;
+    y0 = y1 = pixels[0].y;
+  }
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    x0 = std::min(x0, pixels[i].x);
+    x1 = std::max(x1, pixels[i].x + 1);
+    y0 = std::min(y0, pixels[i].y);
+    y1 = std::max(y1, pixels[i].y + 1);
+  }
+  sprite->x = x0 - origin;
+  sprite->y = y0 - origin;
+  sprite->width = x1 - x0;
+  sprite->height = y1 - y0;
+  sprite->words_per_row = WordsPerRow(sprite->width);
+  const size_t words = sprite->height * sprite->words_per_row;
+  sprite->foreground.assign(words, 0);
+  sprite->covered.assign(background_color ? words : 0, 0);
+
+  // Replay in order: a glyph's background can cover earlier glyphs.
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    const int x = pixels[i].x - x0;
+    const size_t row = (pixels[i].y - y0) * sprite->words_per_row;
+    if (pixels[i].foreground)
+      SetBit(&sprite->foreground[row], x);
+    else
+      ClearBit(&sprite->foreground[row], x);
+    if (background_color)
+      SetBit(&sprite->covered[row], x);
+  }
+  sprite->bytes = sizeof(Sprite) + 2 * sprite->key.size()  // Also in index_.
+    + (sprite->foreground.size() + sprite->covered.size()) * sizeof(uint32_t);
+}
+
+void TextCache::Blit(Canvas *c, const Sprite &sprite, int x, int y,
+                     const Color &color, const Color *background_color) {
+  const int left = x + sprite.x;
+  const int top = y + sprite.y;
+  // Only the part of the sprite that is on the canvas.
+  const int col_begin = std::max(0, -left);
+  const int col_end = std::min(sprite.width, c->width() - left);
+  const int row_begin = std::max(0, -top);
+  const int row_end = std::min(sprite.height, c->height() - top);
+  if (col_begin >= col_end || row_begin >= row_end)
+    return;
+
+  FrameCanvas *frame_canvas = dynamic_cast<FrameCanvas*>(c);
+  if (frame_canvas && (int)span_.size() < col_end - col_begin)
+    span_.resize(col_end - col_begin);
+  const bool with_background = !sprite.covered.empty();
+  for (int row = row_begin; row < row_end; ++row) {
+    const size_t offset = row * sprite.words_per_row;
+    const uint32_t *foreground = &sprite.foreground[offset];
+    const uint32_t *written = with_background
+      ? &sprite.covered[offset] : foreground;
+    for (int a = NextBit(written, col_begin, col_end, true); a < col_end;) {
+      const int b = NextBit(written, a, col_end, false);
+      if (frame_canvas && b - a >= kMinSetPixelsSpan) {
+        for (int i = a; i < b; ++i) {
+          span_[i - a] = (!with_background || TestBit(foreground, i))
+            ? color : *background_color;
+        }
+        frame_canvas->SetPixels(left + a, top + row, b - a, 1, span_.data());
+      } else {
+        for (int i = a; i < b; ++i) {
+          const Color &col = (!with_background || TestBit(foreground, i))
+            ? color : *background_color;
+          c->SetPixel(left + i, top + row, col.r, col.g, col.b);
+        }
+      }
+      a = NextBit(written, b, col_end, true);
+    }
+  }
+}
+
+int TextCache::DrawText(Canvas *c, const Font &font, int x, int y,
+                        const Color &color, const Color *background_color,
+                        const char *utf8_text, int kerning_offset) {
+  // The sprite depends on the font, whether there is a background, the
+  // kerning and the text; not on the colors.
+  const Font *font_ptr = &font;
+  const char with_background = (background_color != NULL);
+  key_.assign((const char*) &font_ptr, sizeof(font_ptr));
+  key_.append(&with_background, 1);
+  key_.append((const char*) &kerning_offset, sizeof(kerning_offset));
+  key_.append(utf8_text);
+
+  std::unordered_map<std::string, SpriteList::iterator>::iterator found
+    = index_.find(key_);
+  if (found != index_.end()) {
+    sprites_.splice(sprites_.begin(), sprites_, found->second);
+  } else {
+    sprites_.push_front(Sprite());
+    Sprite &sprite = sprites_.front();
+    sprite.key = key_;
+    Render(font, background_color, utf8_text, kerning_offset, &sprite);
+    if (sprite.bytes > memory_budget_) {
+      sprites_.pop_front();  // Would not fit anyway.
+      return rgb_matrix::DrawText(c, font, x, y, color, background_color,
+                                  utf8_text, kerning_offset);
+    }
+    index_[sprite.key] = sprites_.begin();
+    memory_used_ += sprite.bytes;
+    while (memory_used_ > memory_budget_) {
+      memory_used_ -= sprites_.back().bytes;
+      index_.erase(sprites_.back().key);
+      sprites_.pop_back();
+    }
+  }
+
+  const Sprite &sprite = sprites_.front();
+  Blit(c, sprite, x, y, color, background_color);
+  return sprite.advance;
+}
+
 int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
                      const Color &color, const Color *background_color,
                      const char *utf8_text, int extra_spacing) {
@@ -89,6 +89,7 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     OPT_COPY_IF_SET(panel_type);
     OPT_COPY_IF_SET(limit_refresh_rate_hz);
     OPT_COPY_IF_SET(disable_busy_waiting);
+    OPT_COPY_IF_SET(pixel_map_cache_dir);
 #undef OPT_COPY_IF_SET
   }
 
@@ -136,6 +137,7 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_OPT(panel_type);
     ACTUAL_VALUE_BACK_TO_OPT(limit_refresh_rate_hz);
     ACTUAL_VALUE_BACK_TO_OPT(disable_busy_waiting);
+    ACTUAL_VALUE_BACK_TO_OPT(pixel_map_cache_dir);
 #undef ACTUAL_VALUE_BACK_TO_OPT
   }
 
@@ -216,6 +218,15 @@ uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix) {
   return to_matrix(matrix)->brightness();
 }
 
+void led_matrix_set_output_brightness(struct RGBLedMatrix *matrix,
+                                      uint8_t percent) {
+  to_matrix(matrix)->SetOutputBrightness(percent);
+}
+
+uint8_t led_matrix_get_output_brightness(struct RGBLedMatrix *matrix) {
+  return to_matrix(matrix)->output_brightness();
+}
+
 void led_canvas_get_size(const struct LedCanvas *canvas,
                          int *width, int *height) {
   rgb_matrix::FrameCanvas *c = to_canvas((struct LedCanvas*)canvas);
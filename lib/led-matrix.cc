@@ -16,6 +16,7 @@
 #include "led-matrix.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <grp.h>
 #include <pwd.h>
 #include <math.h>
@@ -24,11 +25,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
 #include "gpio.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
@@ -87,6 +95,9 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  void SetOutputBrightness(uint8_t percent);
+  uint8_t output_brightness();
+
   uint64_t RequestInputs(uint64_t);
   uint64_t AwaitInputChange(int timeout_ms);
 
@@ -98,8 +109,10 @@ private:
   friend class RGBMatrix;
 
   // Apply pixel mappers that have been passed down via a configuration
-  // string.
-  void ApplyNamedPixelMappers(const char *pixel_mapper_config,
+  // string, preceded by the "multiplex_mapper" if not NULL. All of them
+  // are composed to create the final mapping in one pass.
+  void ApplyNamedPixelMappers(const PixelMapper *multiplex_mapper,
+                              const char *pixel_mapper_config,
                               int chain, int parallel);
 
   Options params_;
@@ -326,10 +339,11 @@ RGBMatrix::Options::Options() :
   limit_refresh_rate_hz(0),
 #endif
 #ifdef DISABLE_BUSY_WAITING
-    disable_busy_waiting(true)
+    disable_busy_waiting(true),
 #else
-    disable_busy_waiting(false)
+    disable_busy_waiting(false),
 #endif
+  pixel_map_cache_dir(NULL)
 {
   // Nothing to see here.
 }
@@ -361,12 +375,81 @@ static void PrintOptions(const RGBMatrix::Options &o) {
   P_STR(panel_type);
   P_INT(limit_refresh_rate_hz);
   P_BOOL(disable_busy_waiting);
+  P_STR(pixel_map_cache_dir);
 #undef P_INT
 #undef P_STR
 #undef P_BOOL
 }
 #endif  // DEBUG_MATRIX_OPTIONS
 
+static uint64_t Fnv1aHash(const std::string &s) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < s.size(); ++i) {
+    hash = (hash ^ (uint8_t)s[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// All the options that influence the pixel mapping go into the key of the
+// cache; a change in any of them results in a new mapping.
+static std::string PixelMapKeyString(const RGBMatrix::Options &o) {
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer), "%d;%d;%d;%d;%d;%d;%d;",
+           o.rows, o.cols, o.chain_length, o.parallel, o.multiplexing,
+           (int) sizeof(internal::DesignatorClass),
+#ifdef ONLY_SINGLE_SUB_PANEL
+           1
+#else
+           2
+#endif
+           );
+  std::string key_string = buffer;
+  key_string.append(o.hardware_mapping ? o.hardware_mapping : "").append(";");
+  key_string.append(o.led_rgb_sequence ? o.led_rgb_sequence : "").append(";");
+  const std::string config = o.pixel_mapper_config ? o.pixel_mapper_config : "";
+  key_string.append(config);
+
+  // The mapping of a Table mapper is in a file; a changed file needs a new
+  // mapping as well.
+  for (size_t start = 0; start < config.size(); ) {
+    size_t end = config.find(';', start);
+    if (end == std::string::npos) end = config.size();
+    const std::string mapper = config.substr(start, end - start);
+    start = end + 1;
+    const size_t colon = mapper.find(':');
+    if (colon == std::string::npos
+        || strcasecmp(mapper.substr(0, colon).c_str(), "Table") != 0)
+      continue;
+    struct stat st;
+    if (stat(mapper.c_str() + colon + 1, &st) != 0) {
+      key_string.append(";-");
+      continue;
+    }
+    snprintf(buffer, sizeof(buffer), ";%lld;%lld.%09ld",
+             (long long) st.st_size, (long long) st.st_mtim.tv_sec,
+             (long) st.st_mtim.tv_nsec);
+    key_string.append(buffer);
+  }
+  return key_string;
+}
+
+static uint64_t PixelMapCacheKey(const RGBMatrix::Options &o) {
+  return Fnv1aHash(PixelMapKeyString(o));
+}
+
+// On top of the mapping, the bits of a frame depend on how colors are
+// encoded into bitplanes, and on the bitplane timing, which decides which
+// planes are shown at reduced brightness.
+uint64_t RGBMatrix::Options::FrameEncodingKey() const {
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer), ";%d;%d;%d;%d;%d;%d;%d;%d;%d;%d;%d",
+           pwm_bits, pwm_lsb_nanoseconds, pwm_dither_bits, brightness,
+           scan_mode, row_address_type, inverse_colors,
+           disable_hardware_pulsing, limit_refresh_rate_hz,
+           (int) sizeof(gpio_bits_t), Framebuffer::kBitPlanes);
+  return Fnv1aHash(PixelMapKeyString(*this) + buffer);
+}
+
 RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
   : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL),
     user_output_bits_(0) {
@@ -391,16 +474,41 @@ RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
 
   Framebuffer::InitHardwareMapping(params_.hardware_mapping);
 
+  // If we have a cached pixel mapping, the first Framebuffer will just use
+  // that instead of creating one.
+  std::string map_cache_file;
+  uint64_t map_cache_key = 0;
+  if (params_.pixel_map_cache_dir && *params_.pixel_map_cache_dir) {
+    map_cache_key = PixelMapCacheKey(options);
+    char filename[64];
+    snprintf(filename, sizeof(filename), "/pixelmap-%016llx.cache",
+             (unsigned long long) map_cache_key);
+    map_cache_file = std::string(params_.pixel_map_cache_dir) + filename;
+    shared_pixel_mapper_ = PixelDesignatorMap::LoadFromFile(
+      map_cache_file.c_str(), map_cache_key,
+      Framebuffer::GpioWordLimit(params_.rows,
+                                 params_.cols * params_.chain_length));
+  }
+  const bool mapping_from_cache = (shared_pixel_mapper_ != NULL);
+
   active_ = CreateFrameCanvas();
   active_->Clear();
   SetGPIO(io, true);
 
-  // We need to apply the mapping for the panels first.
-  ApplyPixelMapper(multiplex_mapper);
+  if (mapping_from_cache)
+    return;
 
-  // .. followed by higher level mappers that might arrange panels.
-  ApplyNamedPixelMappers(options.pixel_mapper_config,
+  // We need to apply the mapping for the panels first, followed by higher
+  // level mappers that might arrange panels.
+  ApplyNamedPixelMappers(multiplex_mapper, options.pixel_mapper_config,
                          params_.chain_length, params_.parallel);
+
+  if (!map_cache_file.empty()
+      && !shared_pixel_mapper_->SaveToFile(map_cache_file.c_str(),
+                                           map_cache_key)) {
+    fprintf(stderr, "Could not write pixel map cache %s\n",
+            map_cache_file.c_str());
+  }
 }
 
 RGBMatrix::Impl::~Impl() {
@@ -438,10 +546,88 @@ void RGBMatrix::Impl::OutputGPIO(uint64_t output_bits) {
   io_->WriteMaskedBits(static_cast<gpio_bits_t>(output_bits), static_cast<gpio_bits_t>(user_output_bits_));
 }
 
-void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
-                                             int chain, int parallel) {
-  if (pixel_mapper_config == NULL || strlen(pixel_mapper_config) == 0)
+namespace {
+// A chain of PixelMappers acting as one: a visible pixel is mapped through
+// all of them, last to first. This way, the final PixelDesignatorMap is
+// created in one pass without any intermediate maps.
+class ComposedPixelMapper : public PixelMapper {
+public:
+  ComposedPixelMapper(int matrix_width, int matrix_height) {
+    Reset(matrix_width, matrix_height);
+  }
+
+  void Reset(int matrix_width, int matrix_height) {
+    mappers_.clear();
+    widths_.assign(1, matrix_width);
+    heights_.assign(1, matrix_height);
+  }
+
+  // Append a mapper. Mappers that can't map the current size are skipped,
+  // just like RGBMatrix::ApplyPixelMapper() would.
+  void Add(const PixelMapper *mapper) {
+    if (mapper == NULL) return;
+    int new_width, new_height;
+    if (!mapper->GetSizeMapping(widths_.back(), heights_.back(),
+                                &new_width, &new_height))
+      return;
+    mappers_.push_back(mapper);
+    widths_.push_back(new_width);
+    heights_.push_back(new_height);
+  }
+
+  bool empty() const { return mappers_.empty(); }
+
+  virtual const char *GetName() const { return "Composed"; }
+
+  virtual bool GetSizeMapping(int matrix_width, int matrix_height,
+                              int *visible_width, int *visible_height)
+    const {
+    if (matrix_width != widths_.front() || matrix_height != heights_.front())
+      return false;
+    *visible_width = widths_.back();
+    *visible_height = heights_.back();
+    return true;
+  }
+
+  virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
+                                  int x, int y,
+                                  int *matrix_x, int *matrix_y) const {
+    for (int i = mappers_.size() - 1; i >= 0; --i) {
+      int orig_x = -1, orig_y = -1;
+      mappers_[i]->MapVisibleToMatrix(widths_[i], heights_[i],
+                                      x, y, &orig_x, &orig_y);
+      if (orig_x < 0 || orig_y < 0 ||
+          orig_x >= widths_[i] || orig_y >= heights_[i]) {
+        x = y = -1;  // Reported by caller.
+        break;
+      }
+      x = orig_x;
+      y = orig_y;
+    }
+    *matrix_x = x;
+    *matrix_y = y;
+  }
+
+private:
+  std::vector<const PixelMapper*> mappers_;
+  std::vector<int> widths_;   // matrix width the mapper at same index sees.
+  std::vector<int> heights_;
+};
+}  // anonymous namespace
+
+void RGBMatrix::Impl::ApplyNamedPixelMappers(
+  const PixelMapper *multiplex_mapper, const char *pixel_mapper_config,
+  int chain, int parallel) {
+  ComposedPixelMapper composed(shared_pixel_mapper_->width(),
+                               shared_pixel_mapper_->height());
+  composed.Add(multiplex_mapper);
+  if (pixel_mapper_config == NULL || strlen(pixel_mapper_config) == 0) {
+    ApplyPixelMapper(composed.empty() ? NULL : &composed);
     return;
+  }
+  // Registered mappers are singletons, so if the same one shows up again
+  // with different parameters, we have to apply what we have so far.
+  std::set<std::string> used_names;
   char *const writeable_copy = strdup(pixel_mapper_config);
   const char *const end = writeable_copy + strlen(writeable_copy);
   char *s = writeable_copy;
@@ -456,11 +642,21 @@ void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
       fprintf(stderr, "Stray parameter ':%s' without mapper name ?\n", optional_param_start);
     }
     if (*s) {
-      ApplyPixelMapper(FindPixelMapper(s, chain, parallel, optional_param_start));
+      std::string lower_name;
+      for (const char *n = s; *n; n++) lower_name.append(1, tolower(*n));
+      if (!used_names.insert(lower_name).second) {
+        if (!composed.empty()) ApplyPixelMapper(&composed);
+        composed.Reset(shared_pixel_mapper_->width(),
+                       shared_pixel_mapper_->height());
+        used_names.clear();
+        used_names.insert(lower_name);
+      }
+      composed.Add(FindPixelMapper(s, chain, parallel, optional_param_start));
     }
     s = semicolon + 1;
   }
   free(writeable_copy);
+  if (!composed.empty()) ApplyPixelMapper(&composed);
 }
 
 void RGBMatrix::Impl::SetGPIO(GPIO *io, bool start_thread) {
@@ -575,9 +771,56 @@ uint8_t RGBMatrix::Impl::brightness() {
   return params_.brightness;
 }
 
+void RGBMatrix::Impl::SetOutputBrightness(uint8_t percent) {
+  Framebuffer::SetOutputBrightness(percent);
+}
+
+uint8_t RGBMatrix::Impl::output_brightness() {
+  return Framebuffer::output_brightness();
+}
+
+namespace {
+// Fills rows [y_start, y_end) of a PixelDesignatorMap with the entries
+// "mapper" points to in the "source" map. Rows are independent, so large
+// maps are split between cores.
+class PixelMapFiller : public Thread {
+public:
+  PixelMapFiller(const PixelMapper *mapper,
+                 PixelDesignatorMap *source, PixelDesignatorMap *target,
+                 int y_start, int y_end)
+    : mapper_(mapper), source_(source), target_(target),
+      y_start_(y_start), y_end_(y_end) {}
+
+  virtual void Run() {
+    const int old_width = source_->width();
+    const int old_height = source_->height();
+    for (int y = y_start_; y < y_end_; ++y) {
+      for (int x = 0; x < target_->width(); ++x) {
+        int orig_x = -1, orig_y = -1;
+        mapper_->MapVisibleToMatrix(old_width, old_height,
+                                    x, y, &orig_x, &orig_y);
+        if (orig_x < 0 || orig_y < 0 ||
+            orig_x >= old_width || orig_y >= old_height) {
+          fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: "
+                  "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
+          continue;
+        }
+        *target_->get(x, y) = *source_->get(orig_x, orig_y);
+      }
+    }
+  }
+
+private:
+  const PixelMapper *const mapper_;
+  PixelDesignatorMap *const source_;
+  PixelDesignatorMap *const target_;
+  const int y_start_;
+  const int y_end_;
+};
+}  // anonymous namespace
+
 bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
   if (mapper == NULL) return true;
-  using internal::PixelDesignatorMap;
   const int old_width = shared_pixel_mapper_->width();
   const int old_height = shared_pixel_mapper_->height();
   int new_width, new_height;
@@ -585,23 +828,29 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
     return false;
   }
   PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
-  for (int y = 0; y < new_height; ++y) {
-    for (int x = 0; x < new_width; ++x) {
-      int orig_x = -1, orig_y = -1;
-      mapper->MapVisibleToMatrix(old_width, old_height,
-                                 x, y, &orig_x, &orig_y);
-      if (orig_x < 0 || orig_y < 0 ||
-          orig_x >= old_width || orig_y >= old_height) {
-        fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: "
-                "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
-        continue;
-      }
-      const internal::PixelDesignator *orig_designator;
-      orig_designator = shared_pixel_mapper_->get(orig_x, orig_y);
-      *new_mapper->get(x, y) = *orig_designator;
-    }
+    new_width, new_height, *shared_pixel_mapper_);
+
+  // Small maps are not worth starting threads.
+  static constexpr int kPixelsPerThread = 1 << 15;
+  const int cpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  const int threads = std::max(1, std::min(std::min(cpus, 4),
+                                           new_width * new_height
+                                           / kPixelsPerThread));
+  std::vector<PixelMapFiller*> fillers;
+  for (int i = 0; i < threads; ++i) {
+    fillers.push_back(new PixelMapFiller(mapper,
+                                         shared_pixel_mapper_, new_mapper,
+                                         i * new_height / threads,
+                                         (i + 1) * new_height / threads));
   }
+  for (int i = 1; i < threads; ++i) fillers[i]->Start();
+  fillers[0]->Run();
+  for (int i = 0; i < threads; ++i) {
+    fillers[i]->WaitStopped();
+    delete fillers[i];
+  }
+
+  new_mapper->UpdateRuns();
   delete shared_pixel_mapper_;
   shared_pixel_mapper_ = new_mapper;
   return true;
@@ -735,6 +984,11 @@ void RGBMatrix::SetBrightness(uint8_t brightness) {
 }
 uint8_t RGBMatrix::brightness() { return impl_->brightness(); }
 
+void RGBMatrix::SetOutputBrightness(uint8_t percent) {
+  impl_->SetOutputBrightness(percent);
+}
+uint8_t RGBMatrix::output_brightness() { return impl_->output_brightness(); }
+
 uint64_t RGBMatrix::RequestInputs(uint64_t all_interested_bits) {
   return impl_->RequestInputs(all_interested_bits);
 }
@@ -789,7 +1043,7 @@ void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
 }
 bool FrameCanvas::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
-uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
+uint8_t FrameCanvas::pwmbits() const { return frame_->pwmbits(); }
 
 // Map brightness of output linearly to input with CIE1931 profile.
 void FrameCanvas::set_luminance_correct(bool on) { frame_->set_luminance_correct(on); }
@@ -807,4 +1061,12 @@ bool FrameCanvas::Deserialize(const char *data, size_t len) {
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
+void FrameCanvas::GetPixel(int x, int y,
+                           uint8_t *red, uint8_t *green, uint8_t *blue) {
+  frame_->GetPixel(x, y, red, green, blue);
+}
+void FrameCanvas::SetScrollOffset(int offset) {
+  frame_->SetScrollOffset(offset);
+}
+int FrameCanvas::scroll_offset() const { return frame_->scroll_offset(); }
 }  // end namespace rgb_matrix
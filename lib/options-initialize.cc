@@ -158,6 +158,9 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeStringFlag("panel-type", it, end,
                             &mopts->panel_type, &err))
         continue;
+      if (ConsumeStringFlag("pixel-map-cache", it, end,
+                            &mopts->pixel_map_cache_dir, &err))
+        continue;
       if (ConsumeIntFlag("rows", it, end, &mopts->rows, &err))
         continue;
       if (ConsumeIntFlag("cols", it, end, &mopts->cols, &err))
@@ -345,7 +348,8 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "(Default: 0)\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n"
           "\t--led-panel-type=<name>   : Needed to initialize special panels. Supported: 'FM6126A', 'FM6127'\n"
-          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n",
+          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n"
+          "\t--led-pixel-map-cache=<dir>: Directory to cache the pixel mapping in for faster startup.\n",
           d.hardware_mapping,
           d.rows, d.cols, d.chain_length, d.parallel,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
@@ -16,11 +16,13 @@
 #include "pixel-mapper.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <map>
+#include <vector>
 
 namespace rgb_matrix {
 namespace {
@@ -283,6 +285,150 @@ private:
   int parallel_;
 };
 
+// Mapping read from a file, e.g. created with utils/pixel-mapper-table
+// from a chain of other mappers, or generated for an unusual installation.
+//   --led-pixel-mapper=Table:/path/to/mapping
+//
+// Text format: '#' starts a comment. First the four numbers
+//   <matrix-width> <matrix-height> <visible-width> <visible-height>
+// followed by a matrix x/y pair for each visible pixel, row by row.
+//
+// Binary format: the PixelMapperTableHeader (see pixel-mapper.h) followed by
+// a uint16_t matrix x/y pair for each visible pixel, row by row.
+class TablePixelMapper : public PixelMapper {
+public:
+  TablePixelMapper() : matrix_width_(0), matrix_height_(0),
+                       visible_width_(0), visible_height_(0) {}
+
+  virtual const char *GetName() const { return "Table"; }
+
+  virtual bool SetParameters(int chain, int parallel, const char *param) {
+    if (param == NULL || strlen(param) == 0) {
+      fprintf(stderr, "Table mapper needs a filename, e.g. Table:map.txt\n");
+      return false;
+    }
+    FILE *f = fopen(param, "rb");
+    if (f == NULL) {
+      perror(param);
+      return false;
+    }
+    PixelMapperTableHeader header;
+    bool success;
+    if (fread(&header, sizeof(header), 1, f) == 1
+        && header.magic == kPixelMapperTableMagic) {
+      success = ReadBinary(header, f);
+    } else {
+      rewind(f);
+      success = ReadText(f);
+    }
+    fclose(f);
+    if (!success)
+      fprintf(stderr, "Table mapper: invalid mapping file %s\n", param);
+    return success;
+  }
+
+  virtual bool GetSizeMapping(int matrix_width, int matrix_height,
+                              int *visible_width, int *visible_height)
+    const {
+    if (matrix_width != matrix_width_ || matrix_height != matrix_height_) {
+      fprintf(stderr, "Table mapper: mapping is for a %dx%d matrix, but "
+              "we have %dx%d\n", matrix_width_, matrix_height_,
+              matrix_width, matrix_height);
+      return false;
+    }
+    *visible_width = visible_width_;
+    *visible_height = visible_height_;
+    return true;
+  }
+
+  virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
+                                  int x, int y,
+                                  int *matrix_x, int *matrix_y) const {
+    const uint16_t *pos = &table_[2 * (y * visible_width_ + x)];
+    *matrix_x = pos[0];
+    *matrix_y = pos[1];
+  }
+
+private:
+  bool ReadBinary(const PixelMapperTableHeader &header, FILE *f) {
+    if (!SetSize(header.matrix_width, header.matrix_height,
+                 header.visible_width, header.visible_height))
+      return false;
+    return fread(&table_[0], sizeof(uint16_t), table_.size(), f)
+      == table_.size() && CheckTable();
+  }
+
+  bool ReadText(FILE *f) {
+    int values[4];
+    for (int i = 0; i < 4; ++i) {
+      if (!ReadNumber(f, &values[i])) return false;
+    }
+    if (!SetSize(values[0], values[1], values[2], values[3]))
+      return false;
+    for (size_t i = 0; i < table_.size(); ++i) {
+      int value;
+      if (!ReadNumber(f, &value) || value < 0 || value > 0xffff)
+        return false;
+      table_[i] = value;
+    }
+    return CheckTable();
+  }
+
+  // Each entry has to point into the matrix.
+  bool CheckTable() const {
+    for (size_t i = 0; i < table_.size(); i += 2) {
+      if (table_[i] >= matrix_width_ || table_[i + 1] >= matrix_height_) {
+        const int pixel = i / 2;
+        fprintf(stderr, "Table mapper: pixel (%d,%d) maps to (%d,%d), "
+                "outside of the %dx%d matrix\n",
+                pixel % visible_width_, pixel / visible_width_,
+                table_[i], table_[i + 1], matrix_width_, matrix_height_);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool ReadNumber(FILE *f, int *value) {
+    for (;;) {
+      if (fscanf(f, "%d", value) == 1)
+        return true;
+      if (fgetc(f) != '#')
+        return false;
+      int c;
+      while ((c = fgetc(f)) != EOF && c != '\n')
+        ;
+    }
+  }
+
+  bool SetSize(int matrix_width, int matrix_height,
+               int visible_width, int visible_height) {
+    if (matrix_width <= 0 || matrix_height <= 0
+        || visible_width <= 0 || visible_height <= 0
+        || matrix_width > 0xffff || matrix_height > 0xffff
+        || visible_width > 0xffff || visible_height > 0xffff)
+      return false;
+    // A visible pixel maps to one matrix pixel; more of them would not
+    // make sense and only serve to make us allocate a huge table.
+    const size_t visible_pixels = (size_t)visible_width * visible_height;
+    if (visible_pixels > (size_t)matrix_width * matrix_height) {
+      fprintf(stderr, "Table mapper: %dx%d visible pixels don't fit into "
+              "the %dx%d matrix\n", visible_width, visible_height,
+              matrix_width, matrix_height);
+      return false;
+    }
+    matrix_width_ = matrix_width;
+    matrix_height_ = matrix_height;
+    visible_width_ = visible_width;
+    visible_height_ = visible_height;
+    table_.assign(2 * visible_pixels, 0);
+    return true;
+  }
+
+  int matrix_width_, matrix_height_;
+  int visible_width_, visible_height_;
+  std::vector<uint16_t> table_;  // matrix x, y for each visible pixel.
+};
 
 typedef std::map<std::string, PixelMapper*> MapperByName;
 static void RegisterPixelMapperInternal(MapperByName *registry,
@@ -302,6 +448,7 @@ static MapperByName *CreateMapperMap() {
   RegisterPixelMapperInternal(result, new UArrangementMapper());
   RegisterPixelMapperInternal(result, new VerticalMapper());
   RegisterPixelMapperInternal(result, new MirrorPixelMapper());
+  RegisterPixelMapperInternal(result, new TablePixelMapper());
   return result;
 }
 
@@ -3,7 +3,22 @@
 #include <glob.h>
 #include "led-matrix.h"
 #include "graphics.h"
+#include "content-streamer.h"
+#include <fcntl.h>
+#include <jpeglib.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <vector>
 #include <string>
@@ -12,9 +27,11 @@
 #include <algorithm>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
-#include <queue>
 
 using namespace rgb_matrix;
 
@@ -23,22 +40,55 @@ static void InterruptHandler(int signo) {
     interrupt_received = true;
 }
 
-/* Draws an image to the screen pixel by pixel, and pixels outside the 
-image width but within the screen width are set to black to prevent shadowing issues. */
-void drawImage(const Magick::Image &image, FrameCanvas *canvas) {
-    const int imageWidth = image.columns();
-    const int imageHeight = image.rows();
-    
-    // Get pixel data as a raw pointer
-    const Magick::PixelPacket *pixels = image.getConstPixels(0, 0, imageWidth, imageHeight);
-    if (!pixels) return; // Fail-safe check
+// A decoded image, packed RGB888 in the size of the canvas. Images smaller
+// than the canvas are padded with black to prevent shadowing issues.
+// Animations keep all their frames one after the other in "pixels".
+struct RGBImage {
+    int width;
+    int height;
+    std::vector<uint8_t> pixels;
+    std::vector<uint32_t> frame_delay_us;  // Per frame; 0 for still images.
+    std::string cache_file;  // Encoded frames of this image; empty if no cache.
+    bool cached;             // If true, not decoded; play the cache_file.
+    int64_t dwell_us;        // Time to show the image.
 
-    const Magick::PixelPacket *pixelPtr = pixels; // Pointer to pixel data
-    for (int y = 0; y < imageHeight; ++y) {
-        for (int x = 0; x < imageWidth; ++x, ++pixelPtr) {
-            canvas->SetPixel(x, y, pixelPtr->red >> 8, pixelPtr->green >> 8, pixelPtr->blue >> 8);
-        }
-    }
+    // Animations are kept encoded in memory. If "encoded" is set, the image
+    // is not decoded; play these frames instead.
+    std::string file_path;
+    uint64_t encoded_key;    // Identifies the version of the file; 0 if unknown.
+    std::shared_ptr<MemStreamIO> encoded;
+
+    // For the Ken Burns effect, the image in a higher resolution than the
+    // canvas. Empty otherwise.
+    std::vector<uint8_t> source;
+    int source_width;
+    int source_height;
+    uint32_t motion;  // Picks the direction of pan and zoom.
+
+    size_t frame_size() const { return 3 * width * height; }
+    uint8_t *frame(size_t i) { return &pixels[i * frame_size()]; }
+    const uint8_t *frame(size_t i) const { return &pixels[i * frame_size()]; }
+};
+
+void drawImage(const RGBImage &image, size_t frame, FrameCanvas *canvas) {
+    SetImage(canvas, 0, 0, image.frame(frame), image.frame_size(),
+             image.width, image.height, false);
+}
+
+static bool has_suffix(const std::string &name, const char *suffix) {
+    const size_t len = strlen(suffix);
+    return name.size() >= len && name.compare(name.size() - len, len, suffix) == 0;
+}
+
+// Only the extension counts, so that e.g. "<image>.dwell" files are not
+// taken for images.
+static bool is_image_file(const std::string &file_name) {
+    return has_suffix(file_name, ".bmp") ||
+        has_suffix(file_name, ".gif") ||
+        has_suffix(file_name, ".jpg") ||
+        has_suffix(file_name, ".jpeg") ||
+        has_suffix(file_name, ".png") ||
+        has_suffix(file_name, ".webp");
 }
 
 std::vector<std::string> get_image_files(const std::string &folder_path) {
@@ -49,12 +99,7 @@ std::vector<std::string> get_image_files(const std::string &folder_path) {
     if ((dir = opendir(folder_path.c_str())) != NULL) {
         while ((ent = readdir(dir)) != NULL) {
             std::string file_name = ent->d_name;
-            if (file_name.find(".bmp") != std::string::npos || 
-                file_name.find(".jpg") != std::string::npos || 
-                file_name.find(".jpeg") != std::string::npos || 
-                file_name.find(".png") != std::string::npos || 
-                file_name.find(".webp") != std::string::npos)
-            {
+            if (is_image_file(file_name)) {
                 files.push_back(folder_path + "/" + file_name);
             }
         }
@@ -69,53 +114,972 @@ std::vector<std::string> get_image_files(const std::string &folder_path) {
     return files;
 }
 
-std::queue<std::unique_ptr<Magick::Image>> image_queue;
-std::mutex queue_mutex;
-std::condition_variable queue_cv;
+// The image files of the slideshow, sorted by name. Files are added and
+// removed while the slideshow is running.
+class Playlist {
+public:
+    explicit Playlist(const std::vector<std::string> &files) : files_(files) {}
 
-void image_loader(const std::vector<std::string> &image_files) {
-    int preloaded = 0;
-    while (!interrupt_received) {
-        for (const auto &file_path : image_files) {
-            if (interrupt_received) break;
-            try {
-                auto image = std::make_unique<Magick::Image>();
-                image->read(file_path);
-                image->resize(Magick::Geometry(128, 64));
-
-                std::unique_lock<std::mutex> lock(queue_mutex);
-                
-                // If queue is empty, don't wait, allow preloading
-                if (preloaded < 3) {  // Preload first 3 images
-                    preloaded++;
-                } else {
-                    queue_cv.wait(lock, [] { return image_queue.size() < 5 || interrupt_received; });
-                }
+    // Returns false if the file already is in the playlist.
+    bool Add(const std::string &file_path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::lower_bound(files_.begin(), files_.end(), file_path);
+        if (it != files_.end() && *it == file_path) return false;
+        files_.insert(it, file_path);
+        return true;
+    }
+
+    // Returns false if the file was not in the playlist.
+    bool Remove(const std::string &file_path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::lower_bound(files_.begin(), files_.end(), file_path);
+        if (it == files_.end() || *it != file_path) return false;
+        files_.erase(it);
+        return true;
+    }
+
+    // Get the file at "position" of the endless repetition of the playlist.
+    // Returns false if the playlist is empty.
+    bool Get(unsigned long position, std::string *file_path) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (files_.empty()) return false;
+        *file_path = files_[position % files_.size()];
+        return true;
+    }
+
+    bool empty() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return files_.empty();
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<std::string> files_;
+};
+
+static std::unique_ptr<RGBImage> new_rgb_image(int width, int height) {
+    std::unique_ptr<RGBImage> image(new RGBImage());
+    image->width = width;
+    image->height = height;
+    image->pixels.resize(image->frame_size());
+    image->frame_delay_us.assign(1, 0);
+    return image;
+}
+
+// A 32 bit counter other threads can block on until it changes. Blocking
+// and waking go through a futex; the wake-up is only a syscall if someone
+// actually waits.
+class FutexCounter {
+public:
+    FutexCounter() : value_(0), waiters_(0) {}
+
+    uint32_t load() const { return value_.load(std::memory_order_acquire); }
+
+    void increment() {
+        value_.fetch_add(1);
+        if (waiters_.load() > 0) {
+            syscall(SYS_futex, &value_, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        }
+    }
+
+    // Block while the value is still "old", but at most "timeout_ms".
+    void wait_while(uint32_t old, int timeout_ms) {
+        struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        waiters_.fetch_add(1);
+        if (value_.load() == old) {
+            syscall(SYS_futex, &value_, FUTEX_WAIT_PRIVATE, old, &timeout, NULL, 0);
+        }
+        waiters_.fetch_sub(1);
+    }
 
-                image_queue.push(std::move(image));
-                lock.unlock();
-                queue_cv.notify_one();
-            } catch (Magick::Exception &error) {
-                std::cerr << "Error loading image " << file_path << ": " << error.what() << std::endl;
+private:
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                  "futex needs a plain 32 bit word");
+    std::atomic<uint32_t> value_;
+    std::atomic<int> waiters_;
+};
+
+// Fixed-capacity ring of decoded images between the loaders and the display.
+// Each slot owns an RGBImage; Push() and Pop() swap buffers with the slot
+// instead of copying them. The display is the only consumer and the loaders
+// take turns being the only producer, so neither side needs a lock. They
+// only block while the ring is full or empty.
+class ImageRing {
+public:
+    ImageRing(size_t capacity, int width, int height) : slots_(capacity) {
+        for (Slot &slot : slots_) slot.image = new_rgb_image(width, height);
+    }
+
+    size_t depth() const { return written_.load() - read_.load(); }
+
+    // Swap "*image" into the next free slot. Returns false if the ring stayed
+    // full for "timeout_ms".
+    bool Push(unsigned long position, std::unique_ptr<RGBImage> *image,
+              int timeout_ms) {
+        const uint32_t written = written_.load();
+        const uint32_t read = read_.load();
+        if (written - read == slots_.size()) {
+            read_.wait_while(read, timeout_ms);
+            if (written - read_.load() == slots_.size()) return false;
+        }
+        Slot &slot = slots_[written % slots_.size()];
+        slot.position = position;
+        slot.image.swap(*image);
+        written_.increment();
+        return true;
+    }
+
+    // Swap the oldest image into "*image". Returns false if the ring stayed
+    // empty for "timeout_ms".
+    bool Pop(unsigned long *position, std::unique_ptr<RGBImage> *image,
+             int timeout_ms) {
+        const uint32_t read = read_.load();
+        const uint32_t written = written_.load();
+        if (written == read) {
+            written_.wait_while(written, timeout_ms);
+            if (written_.load() == read) return false;
+        }
+        Slot &slot = slots_[read % slots_.size()];
+        *position = slot.position;
+        slot.image.swap(*image);
+        read_.increment();
+        return true;
+    }
+
+private:
+    struct Slot {
+        unsigned long position;  // In the endless playlist.
+        std::unique_ptr<RGBImage> image;
+    };
+    std::vector<Slot> slots_;
+    FutexCounter written_;
+    FutexCounter read_;
+};
+
+// Histogram of values in power-of-two buckets: bucket i counts values
+// below 2^i. Recording is a few relaxed atomic operations, so it can be on
+// all the time, also from several threads.
+class Histogram {
+public:
+    static constexpr int kBuckets = 32;
+
+    Histogram() : count_(0), total_(0), max_(0) {
+        for (auto &bucket : buckets_) bucket = 0;
+    }
+
+    void Record(uint64_t value) {
+        const int bucket = value ? std::min(64 - __builtin_clzll(value), kBuckets - 1) : 0;
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        total_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (value > max
+               && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    void Record(std::chrono::steady_clock::duration duration) {
+        Record(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    }
+
+    // Print a line with count, mean, percentiles and maximum. Values are
+    // divided by "scale" for printing. Percentiles are upper bounds given by
+    // the bucket they fall into.
+    void Print(FILE *out, const char *name, double scale, const char *unit) const {
+        const uint64_t count = count_.load(std::memory_order_relaxed);
+        fprintf(out, "%-12s n=%-8llu", name, (unsigned long long)count);
+        if (count == 0) {
+            fprintf(out, "\n");
+            return;
+        }
+        fprintf(out, " mean=%.2f%s", total_.load(std::memory_order_relaxed) / scale / count, unit);
+        const uint64_t max = max_.load(std::memory_order_relaxed);
+        const double percentiles[] = { 0.5, 0.9, 0.99 };
+        uint64_t seen = 0;
+        int bucket = 0;
+        for (const double percentile : percentiles) {
+            while (bucket < kBuckets - 1
+                   && seen + buckets_[bucket].load(std::memory_order_relaxed) < percentile * count) {
+                seen += buckets_[bucket++].load(std::memory_order_relaxed);
             }
+            fprintf(out, " p%g<=%.2f%s", percentile * 100,
+                    std::min<uint64_t>((1ULL << bucket) - 1, max) / scale, unit);
         }
+        fprintf(out, " max=%.2f%s\n", max / scale, unit);
+    }
+
+private:
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> max_;
+};
+
+// Where the time goes in the slideshow pipeline. Durations in microseconds.
+struct PipelineStats {
+    Histogram decode;       // Reading and decompressing files.
+    Histogram resize;       // Scaling to the canvas.
+    Histogram draw;         // Encoding an image into a canvas.
+    Histogram transition;   // Mixing and encoding a transition frame.
+    Histogram swap;         // Waiting in SwapOnVSync().
+    Histogram queue_depth;  // Decoded images ready when the display takes one.
+    std::atomic<uint64_t> missed_deadlines;  // Frames shown >10ms late.
+
+    void Print(FILE *out) const {
+        decode.Print(out, "decode", 1000, "ms");
+        resize.Print(out, "resize", 1000, "ms");
+        draw.Print(out, "draw", 1000, "ms");
+        transition.Print(out, "transition", 1000, "ms");
+        swap.Print(out, "swap", 1000, "ms");
+        queue_depth.Print(out, "queue-depth", 1, "");
+        fprintf(out, "%-12s %llu\n", "missed", (unsigned long long)missed_deadlines.load());
+    }
+};
+
+PipelineStats stats;
+
+// Size of a "width" x "height" image scaled to fit into "max_width" x
+// "max_height", keeping the aspect ratio like a Magick::Geometry resize.
+static void fit_size(int width, int height, int max_width, int max_height,
+                     int *fit_width, int *fit_height) {
+    if ((long)width * max_height > (long)height * max_width) {
+        *fit_width = max_width;
+        *fit_height = std::max(1L, ((long)height * max_width + width / 2) / width);
+    } else {
+        *fit_height = max_height;
+        *fit_width = std::max(1L, ((long)width * max_height + height / 2) / height);
     }
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <image-directory>\n", argv[0]);
-        return 1;
+// Bilinear sampling of packed RGB "src" into "dst_width" x "dst_height" at
+// "dst", which has rows of "dst_stride" bytes. Destination pixel (x, y) is
+// taken from the source at (origin_x + x * step_x, origin_y + y * step_y),
+// all 16.16 fixed point, clamped to the source. Interpolation weights are
+// 8 bit.
+static void sample_bilinear(const uint8_t *src, int src_width, int src_height,
+                            int64_t origin_x, int64_t origin_y,
+                            int64_t step_x, int64_t step_y,
+                            uint8_t *dst, int dst_width, int dst_height,
+                            int dst_stride) {
+    thread_local std::vector<int> x_offset, x_weight;
+    x_offset.resize(dst_width);
+    x_weight.resize(dst_width);
+    const int64_t max_x = (int64_t)(src_width - 1) << 16;
+    for (int x = 0; x < dst_width; ++x) {
+        const int64_t sx = std::min(std::max(origin_x + x * step_x + step_x / 2 - 0x8000,
+                                             (int64_t)0), max_x);
+        x_offset[x] = sx >> 16;
+        x_weight[x] = (sx >> 8) & 0xff;
     }
+    const int64_t max_y = (int64_t)(src_height - 1) << 16;
+    for (int y = 0; y < dst_height; ++y) {
+        const int64_t sy = std::min(std::max(origin_y + y * step_y + step_y / 2 - 0x8000,
+                                             (int64_t)0), max_y);
+        const int y0 = sy >> 16;
+        const int y1 = std::min(y0 + 1, src_height - 1);
+        const int wy = (sy >> 8) & 0xff;
+        const uint8_t *top = src + 3 * y0 * src_width;
+        const uint8_t *bottom = src + 3 * y1 * src_width;
+        uint8_t *out = dst + y * dst_stride;
+        for (int x = 0; x < dst_width; ++x) {
+            const int x0 = 3 * x_offset[x];
+            const int x1 = (x_offset[x] + 1 < src_width) ? x0 + 3 : x0;
+            const int wx = x_weight[x];
+            for (int c = 0; c < 3; ++c) {
+                const int t = top[x0 + c] * (256 - wx) + top[x1 + c] * wx;
+                const int b = bottom[x0 + c] * (256 - wx) + bottom[x1 + c] * wx;
+                *out++ = (t * (256 - wy) + b * wy + (1 << 15)) >> 16;
+            }
+        }
+    }
+}
 
-    const char *folder_path = argv[1];
-    std::vector<std::string> image_files = get_image_files(folder_path);
+// Bilinear scale of all of "src" to "dst_width" x "dst_height".
+static void scale_bilinear(const uint8_t *src, int src_width, int src_height,
+                           uint8_t *dst, int dst_width, int dst_height,
+                           int dst_stride) {
+    sample_bilinear(src, src_width, src_height, 0, 0,
+                    ((int64_t)src_width << 16) / dst_width,
+                    ((int64_t)src_height << 16) / dst_height,
+                    dst, dst_width, dst_height, dst_stride);
+}
 
-    if (image_files.empty()) {
-        fprintf(stderr, "No images found in directory: %s\n", folder_path);
-        return 1;
+// Frames per second of the Ken Burns effect on still images; 0 if off.
+int ken_burns_fps = 0;
+
+// The Ken Burns source is kept at this multiple of the canvas size, which
+// leaves enough detail to zoom in.
+const int kKenBurnsScale = 2;
+
+// Render the frame at "progress" (0..65536) of a slow pan and zoom over the
+// source of "image" into "out", which is in the size of the canvas.
+static void render_ken_burns(const RGBImage &image, int progress, uint8_t *out) {
+    // The largest window with the aspect ratio of the canvas that fits into
+    // the source. The window zooms between this and 3/4 of it, and pans
+    // between opposite corners; "motion" picks the directions.
+    const int64_t source_width = (int64_t)image.source_width << 16;
+    const int64_t source_height = (int64_t)image.source_height << 16;
+    int64_t full_width = source_width;
+    int64_t full_height = source_width / image.width * image.height;
+    if (full_height > source_height) {
+        full_height = source_height;
+        full_width = source_height / image.height * image.width;
+    }
+    const bool zoom_in = image.motion & 1;
+    const int64_t zoom = zoom_in ? 65536 - progress / 4 : 49152 + progress / 4;
+    const int64_t window_width = full_width * zoom >> 16;
+    const int64_t window_height = full_height * zoom >> 16;
+    const int64_t pan_x = (image.motion & 2) ? progress : 65536 - progress;
+    const int64_t pan_y = (image.motion & 4) ? progress : 65536 - progress;
+    sample_bilinear(image.source.data(), image.source_width, image.source_height,
+                    (source_width - window_width) * pan_x >> 16,
+                    (source_height - window_height) * pan_y >> 16,
+                    window_width / image.width, window_height / image.height,
+                    out, image.width, image.height, 3 * image.width);
+}
+
+struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(((JpegErrorManager*)cinfo->err)->setjmp_buffer, 1);
+}
+
+static void jpeg_ignore_message(j_common_ptr cinfo) {}
+
+// Decode a JPEG into packed RGB. The decoder scales it down by 1/2, 1/4 or
+// 1/8 in the DCT domain as long as the result is still at least as large as
+// the image fitted into "max_width" x "max_height", so big photos are never
+// decoded in full resolution. Returns false if libjpeg can not decode the
+// file, e.g. if it is not a JPEG or in CMYK.
+static bool decode_jpeg(const std::string &file_path, int max_width, int max_height,
+                        std::vector<uint8_t> *rgb, int *width, int *height) {
+    FILE *f = fopen(file_path.c_str(), "rb");
+    if (f == NULL) return false;
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_ignore_message;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.dct_method = JDCT_IFAST;
+
+    int fit_width, fit_height;
+    fit_size(cinfo.image_width, cinfo.image_height, max_width, max_height,
+             &fit_width, &fit_height);
+    cinfo.scale_num = 1;
+    for (cinfo.scale_denom = 8; cinfo.scale_denom > 1; cinfo.scale_denom /= 2) {
+        jpeg_calc_output_dimensions(&cinfo);
+        if ((int)cinfo.output_width >= fit_width
+            && (int)cinfo.output_height >= fit_height)
+            break;
+    }
+
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_components != 3) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        return false;
+    }
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    rgb->resize(3 * cinfo.output_width * cinfo.output_height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &(*rgb)[3 * cinfo.output_scanline * cinfo.output_width];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(f);
+    return true;
+}
+
+static bool is_jpeg_file(const std::string &file_path) {
+    return has_suffix(file_path, ".jpg") || has_suffix(file_path, ".jpeg");
+}
+
+// Scale "decoded" to fit into "max_width" x "max_height" and export it as
+// packed RGB.
+static void copy_magick_image(Magick::Image *decoded, int max_width, int max_height,
+                              std::vector<uint8_t> *rgb, int *width, int *height) {
+    const auto start = std::chrono::steady_clock::now();
+    decoded->resize(Magick::Geometry(max_width, max_height));
+    *width = std::min((int)decoded->columns(), max_width);
+    *height = std::min((int)decoded->rows(), max_height);
+    rgb->resize(3 * *width * *height);
+    decoded->write(0, 0, *width, *height, "RGB", Magick::CharPixel, rgb->data());
+    stats.resize.Record(std::chrono::steady_clock::now() - start);
+}
+
+// Copy packed RGB to the top left of "frame" of "image".
+static void copy_to_frame(const std::vector<uint8_t> &rgb, int width, int height,
+                          RGBImage *image, size_t frame) {
+    for (int y = 0; y < height; ++y) {
+        memcpy(image->frame(frame) + 3 * y * image->width, &rgb[3 * y * width], 3 * width);
+    }
+}
+
+// Decode all frames of an animation. Frames are coalesced, so each one is
+// a full picture that can be shown on its own.
+static void decode_animation(const std::vector<Magick::Image> &frames, RGBImage *image) {
+    std::vector<Magick::Image> coalesced;
+    const auto start = std::chrono::steady_clock::now();
+    Magick::coalesceImages(&coalesced, frames.begin(), frames.end());
+    stats.decode.Record(std::chrono::steady_clock::now() - start);
+    image->pixels.assign(coalesced.size() * image->frame_size(), 0);
+    image->frame_delay_us.clear();
+    thread_local std::vector<uint8_t> rgb;
+    int width, height;
+    for (size_t i = 0; i < coalesced.size(); ++i) {
+        // Delays are in 1/100s. Like browsers, we show frames without a
+        // useful delay for 100ms.
+        const size_t delay = coalesced[i].animationDelay();
+        image->frame_delay_us.push_back((delay <= 1 ? 10 : delay) * 10000);
+        copy_magick_image(&coalesced[i], image->width, image->height, &rgb, &width, &height);
+        copy_to_frame(rgb, width, height, image, i);
+    }
+}
+
+// Decode a still image and scale it to fit into "max_width" x "max_height".
+// If ImageMagick already read it, "decoded" is its only frame. Otherwise
+// JPEGs take the fast path through libjpeg, everything else goes through
+// ImageMagick. Throws Magick::Exception.
+static void decode_still(const std::string &file_path, Magick::Image *decoded,
+                         int max_width, int max_height,
+                         std::vector<uint8_t> *rgb, int *width, int *height) {
+    thread_local std::vector<uint8_t> decoded_rgb;
+    int decoded_width, decoded_height;
+    auto start = std::chrono::steady_clock::now();
+    if (decoded != NULL) {
+        copy_magick_image(decoded, max_width, max_height, rgb, width, height);
+    } else if (is_jpeg_file(file_path)
+        && decode_jpeg(file_path, max_width, max_height, &decoded_rgb,
+                       &decoded_width, &decoded_height)) {
+        stats.decode.Record(std::chrono::steady_clock::now() - start);
+        start = std::chrono::steady_clock::now();
+        fit_size(decoded_width, decoded_height, max_width, max_height, width, height);
+        rgb->resize(3 * *width * *height);
+        scale_bilinear(decoded_rgb.data(), decoded_width, decoded_height, rgb->data(),
+                       *width, *height, 3 * *width);
+        stats.resize.Record(std::chrono::steady_clock::now() - start);
+    } else {
+        Magick::Image decoded;
+        decoded.read(file_path);
+        stats.decode.Record(std::chrono::steady_clock::now() - start);
+        copy_magick_image(&decoded, max_width, max_height, rgb, width, height);
+    }
+}
+
+// Decode and scale "file_path" to fit into "image". Files with more than one
+// frame are animations; any format can be animated, except for JPEG. For the
+// Ken Burns effect, still images are kept as larger source, and the first
+// frame is rendered from it. Throws Magick::Exception.
+static void decode_image(const std::string &file_path, RGBImage *image) {
+    image->pixels.assign(image->frame_size(), 0);
+    image->frame_delay_us.assign(1, 0);
+    image->source.clear();
+    std::vector<Magick::Image> frames;
+    if (!is_jpeg_file(file_path)) {
+        const auto start = std::chrono::steady_clock::now();
+        Magick::readImages(&frames, file_path);
+        stats.decode.Record(std::chrono::steady_clock::now() - start);
+        if (frames.empty()) throw Magick::Exception("No frames in " + file_path);
+        if (frames.size() > 1) {
+            decode_animation(frames, image);
+            return;
+        }
+    }
+    Magick::Image *decoded = frames.empty() ? NULL : &frames[0];
+    if (ken_burns_fps > 0) {
+        decode_still(file_path, decoded,
+                     kKenBurnsScale * image->width, kKenBurnsScale * image->height,
+                     &image->source, &image->source_width, &image->source_height);
+        image->motion = std::hash<std::string>()(file_path);
+        render_ken_burns(*image, 0, image->frame(0));
+    } else {
+        thread_local std::vector<uint8_t> rgb;
+        int width, height;
+        decode_still(file_path, decoded, image->width, image->height, &rgb, &width, &height);
+        copy_to_frame(rgb, width, height, image, 0);
+    }
+}
+
+// Images are decoded by a pool of workers, each picking the next playlist
+// position from next_job. They are delivered to image_ring strictly in
+// playlist order: a worker waits until next_delivery reaches its position.
+std::unique_ptr<ImageRing> image_ring;
+std::atomic<unsigned long> next_job(0);
+FutexCounter next_delivery;
+std::atomic<bool> stop_loading(false);
+bool verbose = false;
+
+// Time each image is shown, unless there is a "<image-file>.dwell" file
+// with the number of seconds to show it.
+int64_t default_dwell_us = 5000000;
+
+// With a cache directory, the encoded frames of each image are kept there,
+// so that it is only decoded once.
+std::string cache_dir;
+std::string cache_options;  // Options that determine the encoding.
+
+static bool keep_loading() {
+    return !interrupt_received && !stop_loading;
+}
+
+static uint64_t fnv1a_hash(const std::string &s) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char c : s) {
+        hash = (hash ^ (uint8_t)c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Cache files of "file_path" are named "image-<path-hash>-<key-hash>.stream".
+static std::string image_cache_prefix(const std::string &file_path) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "image-%016llx-",
+             (unsigned long long)fnv1a_hash(file_path));
+    return buffer;
+}
+
+// The key of the encoded frames is derived from everything that changes
+// them: the file, its modification time and the encoding options. So a
+// changed file gets a new key. Returns 0 if the file is not there.
+static uint64_t image_cache_key(const std::string &file_path) {
+    struct stat st;
+    if (stat(file_path.c_str(), &st) != 0) return 0;
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), ";%lld.%09ld;%lld",
+             (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+             (long long)st.st_size);
+    return fnv1a_hash(cache_options + file_path + buffer);
+}
+
+// The name of the cache file is derived from the key. Returns an empty
+// string if there is no cache.
+static std::string image_cache_file(const std::string &file_path) {
+    const uint64_t key = image_cache_key(file_path);
+    if (cache_dir.empty() || key == 0) return "";
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%016llx.stream", (unsigned long long)key);
+    return cache_dir + "/" + image_cache_prefix(file_path) + buffer;
+}
+
+// Memory for animations kept encoded; see EncodedAnimations.
+size_t max_encoded_bytes = 64 << 20;
+
+// Animations encoded in memory, so that each is only decoded and encoded
+// once, even without a cache directory. When more than max_encoded_bytes
+// are used, the animations stored first are dropped.
+class EncodedAnimations {
+public:
+    // Returns the frames of "file_path" if they have the given "key".
+    std::shared_ptr<MemStreamIO> Get(const std::string &file_path, uint64_t key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(file_path);
+        if (it == entries_.end() || it->second.key != key) return nullptr;
+        return it->second.frames;
+    }
+
+    void Put(const std::string &file_path, uint64_t key,
+             const std::shared_ptr<MemStreamIO> &frames, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        RemoveLocked(file_path);
+        if (size > max_encoded_bytes) return;
+        while (total_size_ + size > max_encoded_bytes) RemoveLocked(order_.front());
+        entries_[file_path] = { key, frames, size };
+        order_.push_back(file_path);
+        total_size_ += size;
+    }
+
+    void Remove(const std::string &file_path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        RemoveLocked(file_path);
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        std::shared_ptr<MemStreamIO> frames;
+        size_t size;
+    };
+
+    void RemoveLocked(const std::string &file_path) {
+        auto it = entries_.find(file_path);
+        if (it == entries_.end()) return;
+        total_size_ -= it->second.size;
+        entries_.erase(it);
+        order_.erase(std::find(order_.begin(), order_.end(), file_path));
+    }
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    std::deque<std::string> order_;  // Oldest first.
+    size_t total_size_ = 0;
+};
+EncodedAnimations encoded_animations;
+
+// Remove the cache entries of "file_path" that don't match its current
+// version, after it was changed or removed.
+static void remove_stale_cache_files(const std::string &file_path) {
+    if (cache_dir.empty()) return;
+    const std::string current = image_cache_file(file_path);
+    const std::string prefix = image_cache_prefix(file_path);
+    DIR *dir = opendir(cache_dir.c_str());
+    if (dir == NULL) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        const std::string name = ent->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0 || !has_suffix(name, ".stream"))
+            continue;
+        const std::string cache_file = cache_dir + "/" + name;
+        if (cache_file == current) continue;
+        if (unlink(cache_file.c_str()) == 0 && verbose)
+            fprintf(stderr, "%s: removed stale cache %s\n", file_path.c_str(), cache_file.c_str());
+    }
+    closedir(dir);
+}
+
+static int64_t dwell_time_us(const std::string &file_path) {
+    FILE *f = fopen((file_path + ".dwell").c_str(), "r");
+    if (f == NULL) return default_dwell_us;
+    double seconds;
+    const bool valid = (fscanf(f, "%lf", &seconds) == 1 && seconds >= 0);
+    fclose(f);
+    return valid ? (int64_t)(seconds * 1e6) : default_dwell_us;
+}
+
+// Get "file_path" ready to be shown with "image": decode it, unless its
+// frames already are in the cache. Returns false if it can't be shown.
+static bool load_image(const std::string &file_path, RGBImage *image) {
+    image->dwell_us = dwell_time_us(file_path);
+    image->file_path = file_path;
+    image->encoded_key = image_cache_key(file_path);
+    image->encoded = encoded_animations.Get(file_path, image->encoded_key);
+    if (image->encoded) {
+        image->cache_file.clear();
+        image->cached = false;
+        return true;
+    }
+    image->cache_file = image_cache_file(file_path);
+    image->cached = !image->cache_file.empty()
+        && access(image->cache_file.c_str(), R_OK) == 0;
+    if (image->cached) return true;
+    try {
+        decode_image(file_path, image);
+    } catch (Magick::Exception &error) {
+        std::cerr << "Error loading image " << file_path << ": " << error.what() << std::endl;
+        return false;
+    }
+    // Ken Burns frames are rendered on the fly and not worth caching. Only
+    // animations are cached then.
+    if (!image->source.empty()) image->cache_file.clear();
+    return true;
+}
+
+void image_loader(const Playlist &playlist, int width, int height) {
+    std::unique_ptr<RGBImage> image = new_rgb_image(width, height);
+    while (keep_loading()) {
+        const unsigned long position = next_job++;
+        std::string file_path;
+
+        auto decode_start = std::chrono::steady_clock::now();
+        bool loaded = false;
+        if (playlist.Get(position, &file_path)) {
+            loaded = load_image(file_path, image.get());
+        } else {
+            // Wait for files to show up. Still need to hand over our
+            // position below.
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        std::chrono::duration<double, std::milli> decode_duration =
+            std::chrono::steady_clock::now() - decode_start;
+
+        uint32_t turn;
+        while (keep_loading() && (turn = next_delivery.load()) != (uint32_t)position) {
+            next_delivery.wait_while(turn, 100);
+        }
+        while (keep_loading() && loaded && !image_ring->Push(position, &image, 100)) {
+        }
+        if (!keep_loading()) break;
+
+        if (verbose && loaded) {
+            fprintf(stderr, "%s: %s in %.1fms; queue depth %zu\n",
+                    file_path.c_str(),
+                    image->cached || image->encoded ? "found in cache" : "decoded",
+                    decode_duration.count(), image_ring->depth());
+        }
+        next_delivery.increment();
+    }
+}
+
+// Keep "playlist" in sync with the files in "folder_path". Files are added
+// once they are completely written or moved into the directory.
+static void watch_folder(const std::string &folder_path, Playlist *playlist) {
+    const int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        perror("inotify_init1");
+        return;
+    }
+    if (inotify_add_watch(fd, folder_path.c_str(),
+                          IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE) < 0) {
+        perror(folder_path.c_str());
+        close(fd);
+        return;
+    }
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (keep_loading()) {
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        const ssize_t len = read(fd, buffer, sizeof(buffer));
+        for (ssize_t i = 0; i < len; ) {
+            const struct inotify_event *event = (struct inotify_event *)(buffer + i);
+            i += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0 || !is_image_file(event->name)) continue;
+            const std::string file_path = folder_path + "/" + event->name;
+            remove_stale_cache_files(file_path);
+            encoded_animations.Remove(file_path);
+            if (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) {
+                if (playlist->Add(file_path) && verbose)
+                    fprintf(stderr, "%s: added to playlist\n", file_path.c_str());
+            } else {
+                if (playlist->Remove(file_path) && verbose)
+                    fprintf(stderr, "%s: removed from playlist\n", file_path.c_str());
+            }
+        }
+    }
+    close(fd);
+}
+
+volatile bool stats_requested = false;
+static void StatsHandler(int signo) {
+    stats_requested = true;
+}
+
+// Print the stats on SIGUSR1. With a "stats_file", also write them there
+// every 10 seconds.
+static void report_stats(const std::string &stats_file) {
+    const std::chrono::seconds kStatsInterval(10);
+    auto next_write = std::chrono::steady_clock::now() + kStatsInterval;
+    while (keep_loading()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (stats_requested) {
+            stats_requested = false;
+            stats.Print(stderr);
+        }
+        if (stats_file.empty() || std::chrono::steady_clock::now() < next_write)
+            continue;
+        next_write += kStatsInterval;
+        // Replace the file atomically, so readers never see a partial one.
+        const std::string tmp_file = stats_file + ".tmp";
+        FILE *out = fopen(tmp_file.c_str(), "w");
+        if (out == NULL) {
+            perror(tmp_file.c_str());
+            continue;
+        }
+        stats.Print(out);
+        fclose(out);
+        rename(tmp_file.c_str(), stats_file.c_str());
+    }
+}
+
+// The matrix refresh thread is pinned to core 3 on multi-core Pis; keep the
+// decoders, the display thread and the helper threads away from it.
+static void avoid_refresh_core(pthread_t thread) {
+    const int cores = std::thread::hardware_concurrency();
+    if (cores < 4) return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < cores; ++i) {
+        if (i != 3) CPU_SET(i, &cpus);
+    }
+    pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+}
+
+// The canvas currently shown on the matrix.
+FrameCanvas *shown_canvas = nullptr;
+
+// Wait until "*due", then show "*canvas" and schedule the next frame
+// "hold_time_us" later. Deadlines accumulate, so animations and dwell times
+// keep their pace even if decoding or swapping takes a while.
+static void present(RGBMatrix *matrix, FrameCanvas **canvas,
+                    std::chrono::steady_clock::time_point *due,
+                    uint32_t hold_time_us) {
+    std::this_thread::sleep_until(*due);
+    const auto swap_start = std::chrono::steady_clock::now();
+    if (swap_start - *due > std::chrono::milliseconds(10)) {
+        stats.missed_deadlines.fetch_add(1, std::memory_order_relaxed);
+    }
+    shown_canvas = *canvas;
+    *canvas = matrix->SwapOnVSync(*canvas);
+    stats.swap.Record(std::chrono::steady_clock::now() - swap_start);
+    // Don't try to catch up on a backlog of more than 100ms.
+    *due = std::max(*due, std::chrono::steady_clock::now() - std::chrono::milliseconds(100))
+        + std::chrono::microseconds(hold_time_us);
+}
+
+// Show the frames stored in "input" once. Returns the number of frames
+// shown; 0 if the stream is not usable.
+static int play_stream(StreamIO *input, RGBMatrix *matrix,
+                       FrameCanvas **offscreen_canvas,
+                       std::chrono::steady_clock::time_point *next_frame) {
+    StreamReader reader(input);
+    int frames_shown = 0;
+    uint32_t hold_time_us = 0;
+    while (!interrupt_received && reader.GetNext(*offscreen_canvas, &hold_time_us)) {
+        present(matrix, offscreen_canvas, next_frame, hold_time_us);
+        ++frames_shown;
+    }
+    return frames_shown;
+}
+
+// Show the frames stored in "cache_file" once, like play_stream().
+static int play_cache(const std::string &cache_file, RGBMatrix *matrix,
+                      FrameCanvas **offscreen_canvas,
+                      std::chrono::steady_clock::time_point *next_frame) {
+    const int fd = open(cache_file.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    MemMapViewInput input(fd);
+    if (!input.IsInitialized()) return 0;
+    return play_stream(&input, matrix, offscreen_canvas, next_frame);
+}
+
+// Load the first frame of the encoded "image" into "canvas".
+static bool load_encoded_frame(const RGBImage &image, FrameCanvas *canvas) {
+    if (image.encoded) {
+        StreamReader reader(image.encoded.get());
+        return reader.GetNext(canvas, nullptr);
+    }
+    const int fd = open(image.cache_file.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    MemMapViewInput input(fd);
+    if (!input.IsInitialized()) return false;
+    StreamReader reader(&input);
+    return reader.GetNext(canvas, nullptr);
+}
+
+// Read back the colors of "canvas". These are only approximately the
+// original colors, as they went through the PWM bit and brightness mapping.
+static void canvas_to_rgb(FrameCanvas *canvas, uint8_t *rgb) {
+    for (int y = 0; y < canvas->height(); ++y) {
+        for (int x = 0; x < canvas->width(); ++x, rgb += 3) {
+            canvas->GetPixel(x, y, &rgb[0], &rgb[1], &rgb[2]);
+        }
+    }
+}
+
+enum Transition { kNoTransition, kCrossfade, kWipe, kDissolve };
+
+// Random order in which pixels switch in a dissolve, repeated for each
+// color channel of a pixel.
+std::vector<uint8_t> dissolve_order;
+
+static void init_dissolve_order(int width, int height) {
+    dissolve_order.resize(3 * width * height);
+    uint32_t random = 0x2545f491;
+    for (size_t i = 0; i < dissolve_order.size(); i += 3) {
+        random ^= random << 13;  // xorshift32
+        random ^= random >> 17;
+        random ^= random << 5;
+        dissolve_order[i] = dissolve_order[i+1] = dissolve_order[i+2] = random >> 24;
+    }
+}
+
+// Mix the packed RGB images "from" and "to" into "out" for a "progress"
+// from 0 (only "from") to 256 (only "to"). The loops are kept simple enough
+// for the compiler to vectorize.
+static void blend_transition(Transition transition, const uint8_t *from,
+                             const uint8_t *to, int width, int height,
+                             int progress, uint8_t *out) {
+    const int size = 3 * width * height;
+    switch (transition) {
+    case kCrossfade:
+        for (int i = 0; i < size; ++i) {
+            out[i] = (from[i] * (256 - progress) + to[i] * progress) >> 8;
+        }
+        break;
+    case kWipe: {
+        const int split = 3 * (width * progress / 256);
+        for (int y = 0; y < height; ++y) {
+            const int row = 3 * width * y;
+            memcpy(out + row, to + row, split);
+            memcpy(out + row + split, from + row + split, 3 * width - split);
+        }
+        break;
+    }
+    case kDissolve:
+        for (int i = 0; i < size; ++i) {
+            out[i] = dissolve_order[i] < progress ? to[i] : from[i];
+        }
+        break;
+    case kNoTransition:
+        break;
+    }
+}
+
+// Show a transition from "from" to "to" with the "spare_canvases", which are
+// all encoded before the first of them is due, i.e. while the previous
+// image is still shown. Afterwards, "spare_canvases" contains the canvases
+// that are no longer shown.
+static void play_transition(Transition transition, const uint8_t *from,
+                            const uint8_t *to, uint32_t frame_time_us,
+                            RGBMatrix *matrix,
+                            std::vector<FrameCanvas*> *spare_canvases,
+                            std::chrono::steady_clock::time_point *next_frame) {
+    const int width = matrix->width();
+    const int height = matrix->height();
+    thread_local std::vector<uint8_t> mixed;
+    mixed.resize(3 * width * height);
+    const int frames = spare_canvases->size();
+    for (int i = 0; i < frames; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        blend_transition(transition, from, to, width, height,
+                         256 * (i + 1) / (frames + 1), mixed.data());
+        SetImage((*spare_canvases)[i], 0, 0, mixed.data(), mixed.size(),
+                 width, height, false);
+        stats.transition.Record(std::chrono::steady_clock::now() - start);
+    }
+    for (FrameCanvas *&canvas : *spare_canvases) {
+        present(matrix, &canvas, next_frame, frame_time_us);  // Swaps canvas.
+        if (interrupt_received) break;
     }
+}
+
+static int usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [options] <image-directory>\n", progname);
+    fprintf(stderr, "Options:\n"
+            "\t-c <dir>     : Cache the encoded images in this directory, so that\n"
+            "\t               each is only decoded once.\n"
+            "\t-d <seconds> : Time to show each image (Default: 5). Override\n"
+            "\t               per image with a <image-file>.dwell file.\n"
+            "\t-j <workers> : Number of image decoders (Default: cores - 1).\n"
+            "\t-k <fps>     : Slowly pan and zoom over still images, rendered at\n"
+            "\t               this frame rate (Default: 0, off).\n"
+            "\t-m <MiB>     : Memory to keep animations encoded in, so that each\n"
+            "\t               is only decoded once (Default: 64).\n"
+            "\t-t <effect>  : Transition between images: crossfade, wipe or\n"
+            "\t               dissolve (Default: none).\n"
+            "\t-T <ms>      : Duration of the transition, up to 60000 (Default: 500).\n"
+            "\t-q <depth>   : Number of decoded images to keep ready (Default: 5).\n"
+            "\t-s <file>    : Write pipeline stats to this file every 10s. They\n"
+            "\t               are printed to stderr on SIGUSR1 as well.\n"
+            "\t-v           : Report decode time and queue depth per image.\n\n");
+    rgb_matrix::PrintMatrixFlags(stderr);
+    return 1;
+}
 
+int main(int argc, char **argv) {
     RGBMatrix::Options matrix_options;
     RuntimeOptions runtime_options;
 
@@ -133,10 +1097,50 @@ int main(int argc, char **argv) {
     matrix_options.show_refresh_rate = true;
 
     if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv, &matrix_options, &runtime_options)) {
-        rgb_matrix::PrintMatrixFlags(stderr);
+        return usage(argv[0]);
+    }
+
+    int workers = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    int queue_depth = 5;
+    Transition transition = kNoTransition;
+    int transition_ms = 500;
+    const char *stats_file = "";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:j:k:m:q:s:t:T:v")) != -1) {
+        switch (opt) {
+        case 'c': cache_dir = optarg; break;
+        case 'd': default_dwell_us = std::max(0.0, atof(optarg)) * 1e6; break;
+        case 'j': workers = std::max(1, atoi(optarg)); break;
+        case 'k': ken_burns_fps = std::max(0, atoi(optarg)); break;
+        case 'm': max_encoded_bytes = (size_t)std::max(0, atoi(optarg)) << 20; break;
+        case 'q': queue_depth = std::max(1, atoi(optarg)); break;
+        case 's': stats_file = optarg; break;
+        case 't':
+            if (strcmp(optarg, "crossfade") == 0) transition = kCrossfade;
+            else if (strcmp(optarg, "wipe") == 0) transition = kWipe;
+            else if (strcmp(optarg, "dissolve") == 0) transition = kDissolve;
+            else return usage(argv[0]);
+            break;
+        case 'T': transition_ms = std::min(60000, std::max(0, atoi(optarg))); break;
+        case 'v': verbose = true; break;
+        default: return usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        return usage(argv[0]);
+    }
+
+    const char *folder_path = argv[optind];
+    Playlist playlist(get_image_files(folder_path));
+    if (playlist.empty()) {
+        fprintf(stderr, "No images found in directory: %s\n", folder_path);
         return 1;
     }
 
+    // We decode images in parallel ourselves; one thread per image is
+    // enough for ImageMagick then.
+    setenv("MAGICK_THREAD_LIMIT", "1", 0);
+
     RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_options);
     if (matrix == NULL) {
         return 1;
@@ -150,38 +1154,185 @@ int main(int argc, char **argv) {
 
     signal(SIGTERM, InterruptHandler);
     signal(SIGINT, InterruptHandler);
+    signal(SIGUSR1, StatsHandler);
+
+    char encoding_key[32];
+    snprintf(encoding_key, sizeof(encoding_key), "%016llx;",
+             (unsigned long long)matrix_options.FrameEncodingKey());
+    cache_options = encoding_key;
+    if (ken_burns_fps > 0) cache_options += "ken-burns;";  // No still images.
+
+    const int width = offscreen_canvas->width();
+    const int height = offscreen_canvas->height();
+    image_ring.reset(new ImageRing(queue_depth, width, height));
+    // Threads started from here on inherit the affinity.
+    avoid_refresh_core(pthread_self());
+    std::vector<std::thread> loader_threads;
+    for (int i = 0; i < workers; ++i) {
+        loader_threads.emplace_back(image_loader, std::cref(playlist), width, height);
+    }
+    loader_threads.emplace_back(watch_folder, folder_path, &playlist);
+    loader_threads.emplace_back(report_stats, stats_file);
 
-    std::thread loader_thread(image_loader, std::ref(image_files));
+    // Transitions are shown with their own set of canvases, about one per
+    // 20ms, all created up front.
+    const int transition_frames = std::min(50, transition_ms / 20);
+    if (transition_frames == 0) transition = kNoTransition;
+    std::vector<FrameCanvas*> spare_canvases;
+    std::vector<uint8_t> shown_rgb;  // Last frame, for the next transition.
+    std::vector<uint8_t> next_rgb;
+    bool have_shown_rgb = false;
+    if (transition != kNoTransition) {
+        for (int i = 0; i < transition_frames; ++i) {
+            spare_canvases.push_back(matrix->CreateFrameCanvas());
+        }
+        shown_rgb.resize(3 * width * height);
+        next_rgb.resize(3 * width * height);
+        if (transition == kDissolve) init_dissolve_order(width, height);
+    }
 
+    std::unique_ptr<RGBImage> image = new_rgb_image(width, height);
+    auto next_frame = std::chrono::steady_clock::now();
     while (!interrupt_received) {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        queue_cv.wait(lock, []{ return !image_queue.empty() || interrupt_received; });
+        unsigned long position;
+        if (!image_ring->Pop(&position, &image, 100)) continue;
+        stats.queue_depth.Record(image_ring->depth());
 
-        if (interrupt_received) break;
+        if (transition != kNoTransition && have_shown_rgb) {
+            const uint8_t *to = image->frame(0);
+            if (image->cached || image->encoded) {
+                to = nullptr;
+                if (load_encoded_frame(*image, offscreen_canvas)) {
+                    canvas_to_rgb(offscreen_canvas, next_rgb.data());
+                    to = next_rgb.data();
+                }
+            }
+            if (to) {
+                play_transition(transition, shown_rgb.data(), to,
+                                1000LL * transition_ms / transition_frames,
+                                matrix, &spare_canvases, &next_frame);
+            }
+        }
+
+        // The next image is prepared while the current one is still shown,
+        // so it appears right when its dwell time is over. Animations repeat
+        // until then.
+        const auto image_end = std::max(next_frame, std::chrono::steady_clock::now())
+            + std::chrono::microseconds(image->dwell_us);
+
+        if (image->cached || image->encoded) {
+            int frames;
+            do {
+                frames = image->encoded
+                    ? play_stream(image->encoded.get(), matrix, &offscreen_canvas, &next_frame)
+                    : play_cache(image->cache_file, matrix, &offscreen_canvas, &next_frame);
+            } while (!interrupt_received && frames > 1 && next_frame < image_end);
+            if (frames == 0 && !interrupt_received) {
+                if (image->encoded) {
+                    encoded_animations.Remove(image->file_path);
+                } else {
+                    fprintf(stderr, "Image cache %s not usable.\n", image->cache_file.c_str());
+                    unlink(image->cache_file.c_str());  // Decode again next time.
+                }
+            }
+            if (transition != kNoTransition && frames > 0) {
+                canvas_to_rgb(shown_canvas, shown_rgb.data());
+                have_shown_rgb = true;
+            }
+            next_frame = std::max(next_frame, image_end);
+            continue;
+        }
 
-        std::unique_ptr<Magick::Image> image = std::move(image_queue.front());
-        image_queue.pop();
-        lock.unlock();
-        queue_cv.notify_one();
+        // Record the frames into the cache while they are shown.
+        const std::string cache_tmp_file = image->cache_file + ".tmp";
+        std::unique_ptr<FileStreamIO> cache_output;
+        std::unique_ptr<StreamWriter> cache_writer;
+        if (!image->cache_file.empty()) {
+            const int fd = open(cache_tmp_file.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
+            if (fd >= 0) {
+                cache_output.reset(new FileStreamIO(fd));
+                cache_writer.reset(new StreamWriter(cache_output.get(), false));
+            } else {
+                perror(cache_tmp_file.c_str());
+            }
+        }
 
-        auto draw_start = std::chrono::high_resolution_clock::now();
-        drawImage(*image, offscreen_canvas);
-        auto draw_end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double, std::milli> draw_duration = draw_end - draw_start;
-//        std::cout << "Image draw time: " << draw_duration.count() << " ms" << std::endl;
+        if (!image->source.empty()) {
+            // Ken Burns: render frames from the source for the whole dwell time.
+            const uint32_t frame_time_us = 1000000 / ken_burns_fps;
+            const int frames = std::max<int64_t>(1, (image_end - next_frame)
+                                                 / std::chrono::microseconds(frame_time_us));
+            for (int i = 0; i < frames && !interrupt_received; ++i) {
+                const auto draw_start = std::chrono::steady_clock::now();
+                if (i > 0) render_ken_burns(*image, 65536LL * i / (frames - 1), image->frame(0));
+                drawImage(*image, 0, offscreen_canvas);
+                stats.draw.Record(std::chrono::steady_clock::now() - draw_start);
+                present(matrix, &offscreen_canvas, &next_frame, frame_time_us);
+            }
+        } else {
+            // Animations are encoded in their first round. Repeats and later
+            // rounds of the playlist play the encoded frames.
+            std::shared_ptr<MemStreamIO> encoded;
+            std::unique_ptr<StreamWriter> encoded_writer;
+            size_t encoded_size = 0;
+            if (image->frame_delay_us.size() > 1 && image->encoded_key != 0) {
+                encoded.reset(new MemStreamIO());
+                encoded_writer.reset(new StreamWriter(encoded.get(), false));
+            }
+            for (size_t frame = 0; frame < image->frame_delay_us.size(); ++frame) {
+                const auto draw_start = std::chrono::steady_clock::now();
+                drawImage(*image, frame, offscreen_canvas);
+                stats.draw.Record(std::chrono::steady_clock::now() - draw_start);
 
-        auto swap_start = std::chrono::high_resolution_clock::now();
-        offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas);
-        auto swap_end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double, std::milli> swap_duration = swap_end - swap_start;
-//        std::cout << "Canvas swap time: " << swap_duration.count() << " ms" << std::endl;
+                const uint32_t hold_time_us = image->frame_delay_us[frame];
+                if (cache_writer && !cache_writer->Stream(*offscreen_canvas, hold_time_us)) {
+                    fprintf(stderr, "Could not write image cache %s\n", cache_tmp_file.c_str());
+                    cache_writer.reset();
+                }
+                if (encoded_writer) {
+                    const char *data;
+                    size_t len;
+                    offscreen_canvas->Serialize(&data, &len);
+                    encoded_writer->Stream(*offscreen_canvas, hold_time_us);
+                    encoded_size += len;
+                }
 
-//        std::cout << "Displayed image" << std::endl;
+                present(matrix, &offscreen_canvas, &next_frame, hold_time_us);
+                if (interrupt_received) break;
+            }
 
-        //usleep(25000000); // 25ms delay
+            if (cache_output) {
+                const bool cache_complete = cache_writer && !interrupt_received;
+                cache_writer.reset();
+                cache_output.reset();
+                if (cache_complete) {
+                    rename(cache_tmp_file.c_str(), image->cache_file.c_str());
+                } else {
+                    unlink(cache_tmp_file.c_str());
+                }
+            }
+            if (encoded_writer && !interrupt_received) {
+                encoded_writer.reset();
+                encoded_animations.Put(image->file_path, image->encoded_key, encoded,
+                                       encoded_size);
+                int frames = 1;
+                while (!interrupt_received && frames > 0 && next_frame < image_end) {
+                    frames = play_stream(encoded.get(), matrix, &offscreen_canvas, &next_frame);
+                }
+            }
+        }
+        if (transition != kNoTransition) {
+            memcpy(shown_rgb.data(), image->frame(image->frame_delay_us.size() - 1),
+                   shown_rgb.size());
+            have_shown_rgb = true;
+        }
+        next_frame = std::max(next_frame, image_end);
     }
 
-    loader_thread.join();
+    stop_loading = true;
+    for (auto &loader_thread : loader_threads) {
+        loader_thread.join();
+    }
 
     delete matrix;
     return 0;
@@ -0,0 +1,56 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Compile a BDF font into the binary format that Font::LoadFont() memory
+// maps directly. Large fonts (think unifont) then load instantly and only
+// the glyphs actually drawn are paged in, shared by all processes using it.
+// The compiled file is specific to the machine architecture, so run this on
+// the machine (or at least the kind of machine) that uses the font.
+
+#include "graphics.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+using rgb_matrix::Font;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] <input.bdf> <output-file>\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-O : Write the outline version of the font "
+          "(see Font::CreateOutlineFont()).\n");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  bool outline = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "O")) != -1) {
+    switch (opt) {
+    case 'O': outline = true; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 2)
+    return usage(argv[0]);
+  const char *in_filename = argv[optind];
+  const char *out_filename = argv[optind + 1];
+
+  Font font;
+  if (!font.LoadFont(in_filename) || font.height() < 0) {
+    fprintf(stderr, "Could not load font %s\n", in_filename);
+    return 1;
+  }
+  Font *outline_font = outline ? font.CreateOutlineFont() : NULL;
+  const Font &result = outline_font ? *outline_font : font;
+  const bool success = result.WriteCompiledFont(out_filename);
+  const int height = result.height();
+  delete outline_font;
+  if (!success) {
+    fprintf(stderr, "Could not write %s\n", out_filename);
+    return 1;
+  }
+  fprintf(stderr, "Wrote %s font of height %d to %s\n",
+          outline ? "outline" : "regular", height, out_filename);
+  return 0;
+}
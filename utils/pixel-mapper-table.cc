@@ -0,0 +1,152 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Flatten a --led-pixel-mapper chain into a single mapping file that can be
+// used with --led-pixel-mapper=Table:<file>. The resulting mapping is applied
+// in one pass at startup, regardless of how long the original chain was. The
+// file is also a good starting point to hand-edit unusual installations.
+
+#include "led-matrix.h"
+#include "pixel-mapper.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using rgb_matrix::PixelMapper;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RuntimeOptions;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] [led-flags] <output-file>\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-t : Write text format instead of binary.\n\n"
+          "The --led-pixel-mapper chain, together with the other --led-* "
+          "flags\ndescribing the display, is written as a Table mapping.\n\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options options;
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;
+  runtime.daemon = -1;
+  runtime.drop_privileges = -1;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv, &options, &runtime))
+    return usage(argv[0]);
+
+  bool text_output = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t")) != -1) {
+    switch (opt) {
+    case 't': text_output = true; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    return usage(argv[0]);
+  const char *out_filename = argv[optind];
+
+  // The matrix without named pixel mappers gives us the size the chain
+  // starts with (after multiplexing).
+  const std::string mapper_config = options.pixel_mapper_config
+    ? options.pixel_mapper_config : "";
+  options.pixel_mapper_config = NULL;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(options, runtime);
+  if (matrix == NULL)
+    return 1;
+  const int matrix_width = matrix->width();
+  const int matrix_height = matrix->height();
+  delete matrix;
+
+  // Apply one mapper after another on a table of matrix coordinates.
+  int width = matrix_width;
+  int height = matrix_height;
+  std::vector<uint16_t> table(2 * width * height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      table[2 * (y * width + x)] = x;
+      table[2 * (y * width + x) + 1] = y;
+    }
+  }
+
+  std::vector<char> config(mapper_config.begin(), mapper_config.end());
+  config.push_back('\0');
+  char *saveptr = NULL;
+  for (char *s = strtok_r(config.data(), ";", &saveptr); s != NULL;
+       s = strtok_r(NULL, ";", &saveptr)) {
+    char *param = strchr(s, ':');
+    if (param) *param++ = '\0';
+    const PixelMapper *mapper = rgb_matrix::FindPixelMapper(
+      s, options.chain_length, options.parallel, param);
+    if (mapper == NULL)
+      return 1;
+    int new_width, new_height;
+    if (!mapper->GetSizeMapping(width, height, &new_width, &new_height))
+      return 1;
+    std::vector<uint16_t> new_table(2 * new_width * new_height);
+    for (int y = 0; y < new_height; ++y) {
+      for (int x = 0; x < new_width; ++x) {
+        int orig_x = -1, orig_y = -1;
+        mapper->MapVisibleToMatrix(width, height, x, y, &orig_x, &orig_y);
+        if (orig_x < 0 || orig_y < 0 || orig_x >= width || orig_y >= height) {
+          fprintf(stderr, "Error in %s: (%d, %d) -> (%d, %d) [range: "
+                  "%dx%d]\n", mapper->GetName(), x, y, orig_x, orig_y,
+                  width, height);
+          return 1;
+        }
+        const int from = 2 * (orig_y * width + orig_x);
+        new_table[2 * (y * new_width + x)] = table[from];
+        new_table[2 * (y * new_width + x) + 1] = table[from + 1];
+      }
+    }
+    table.swap(new_table);
+    width = new_width;
+    height = new_height;
+  }
+
+  FILE *out = fopen(out_filename, text_output ? "w" : "wb");
+  if (out == NULL) {
+    perror(out_filename);
+    return 1;
+  }
+  bool success;
+  if (text_output) {
+    fprintf(out, "# Generated from --led-pixel-mapper=\"%s\"\n"
+            "# <matrix-width> <matrix-height> <visible-width> "
+            "<visible-height>\n%d %d %d %d\n"
+            "# matrix x/y of each visible pixel, one row per line.\n",
+            mapper_config.c_str(), matrix_width, matrix_height, width, height);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        fprintf(out, "%s%d %d", x == 0 ? "" : "  ",
+                table[2 * (y * width + x)], table[2 * (y * width + x) + 1]);
+      }
+      fputc('\n', out);
+    }
+    success = !ferror(out);
+  } else {
+    rgb_matrix::PixelMapperTableHeader header;
+    header.magic = rgb_matrix::kPixelMapperTableMagic;
+    header.matrix_width = matrix_width;
+    header.matrix_height = matrix_height;
+    header.visible_width = width;
+    header.visible_height = height;
+    success = (fwrite(&header, sizeof(header), 1, out) == 1
+               && fwrite(table.data(), sizeof(uint16_t), table.size(), out)
+               == table.size());
+  }
+  success &= (fclose(out) == 0);
+  if (!success) {
+    fprintf(stderr, "Could not write %s\n", out_filename);
+    return 1;
+  }
+  fprintf(stderr, "Wrote %dx%d -> %dx%d mapping to %s\n",
+          matrix_width, matrix_height, width, height, out_filename);
+  return 0;
+}
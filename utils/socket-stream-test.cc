@@ -0,0 +1,190 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Self-test of SocketStreamIO (see content-streamer.h), with a local
+// socketpair standing in for the network. Needs no hardware; exits with
+// a non-zero status if any check fails.
+
+#include "led-matrix.h"
+#include "content-streamer.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RuntimeOptions;
+using rgb_matrix::SocketStreamIO;
+using rgb_matrix::StreamIO;
+using rgb_matrix::StreamReader;
+using rgb_matrix::StreamWriter;
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                       \
+    }                                                                   \
+  } while (0)
+
+// Collects what a StreamWriter writes, so that we can send a corrupted
+// version of it.
+class StringStreamIO : public StreamIO {
+public:
+  void Rewind() final {}
+  ssize_t Read(void *buf, size_t count) final { return -1; }
+  ssize_t Append(const void *buf, size_t count) final {
+    data.append((const char*)buf, count);
+    return count;
+  }
+
+  std::string data;
+};
+
+static FrameCanvas *CreateCanvas(int rows, int cols) {
+  RGBMatrix::Options options;
+  options.rows = rows;
+  options.cols = cols;
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;
+  runtime.daemon = -1;
+  runtime.drop_privileges = -1;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(options, runtime);
+  return matrix ? matrix->CreateFrameCanvas() : NULL;
+}
+
+// Connected reader and writer ends.
+static void CreatePair(const FrameCanvas &reader_frame,
+                       const FrameCanvas &writer_frame,
+                       SocketStreamIO **reader, SocketStreamIO **writer) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  *reader = new SocketStreamIO(fds[0], reader_frame);
+  *writer = new SocketStreamIO(fds[1], writer_frame);
+}
+
+// Frames arriving faster than they are read: only the latest one is shown.
+static void TestLatestFrameWins(FrameCanvas *canvas) {
+  SocketStreamIO *in, *out;
+  CreatePair(*canvas, *canvas, &in, &out);
+  StreamWriter *writer = new StreamWriter(out, false);
+  StreamReader reader(in);
+
+  char buffer[64];
+  CHECK(in->Read(buffer, sizeof(buffer)) == 0);  // Nothing sent yet.
+  CHECK(in->IsConnected());
+
+  uint32_t hold_time_us = 0;
+  CHECK(!reader.GetNext(canvas, &hold_time_us));
+  for (int i = 1; i <= 3; ++i) {
+    canvas->SetPixel(i, 0, 255, 0, 0);
+    writer->Stream(*canvas, i);
+  }
+  canvas->Clear();
+  CHECK(reader.GetNext(canvas, &hold_time_us));
+  CHECK(hold_time_us == 3);
+  uint8_t r, g, b;
+  canvas->GetPixel(3, 0, &r, &g, &b);
+  CHECK(r == 255);
+  CHECK(in->GetStats().frames_received == 3);
+  CHECK(in->GetStats().frames_dropped == 2);
+
+  // Nothing new: keep showing the current frame.
+  CHECK(!reader.GetNext(canvas, &hold_time_us));
+  CHECK(in->Read(buffer, sizeof(buffer)) == 0);
+  CHECK(in->IsConnected());
+
+  writer->Stream(*canvas, 4);
+  CHECK(reader.GetNext(canvas, &hold_time_us));
+  CHECK(hold_time_us == 4);
+  CHECK(in->GetStats().frames_received == 4);
+  CHECK(in->GetStats().frames_dropped == 2);
+
+  delete writer;
+  delete out;
+  CHECK(!reader.GetNext(canvas, &hold_time_us));
+  CHECK(!in->IsConnected());
+  delete in;
+}
+
+// A stream of another frame size is not buffered, but disconnected.
+static void TestFrameSizeMismatch(FrameCanvas *canvas, FrameCanvas *other) {
+  SocketStreamIO *in, *out;
+  CreatePair(*canvas, *other, &in, &out);
+  StreamWriter *writer = new StreamWriter(out, false);
+  StreamReader reader(in);
+  writer->Stream(*other, 1);
+  uint32_t hold_time_us = 0;
+  CHECK(!reader.GetNext(canvas, &hold_time_us));
+  CHECK(!in->IsConnected());
+  CHECK(in->GetStats().frames_received == 0);
+  delete in;
+  delete writer;
+  delete out;
+}
+
+// Sends "size" bytes of "data" completely.
+static void SendAll(StreamIO *out, const char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t w = out->Append(data, size);
+    if (w <= 0) return;
+    data += w;
+    size -= w;
+  }
+}
+
+// A corrupt header of a frame that would be dropped still disconnects.
+static void TestDesyncedStream(FrameCanvas *canvas) {
+  StringStreamIO recorded;
+  StreamWriter *writer = new StreamWriter(&recorded, false);
+  writer->Stream(*canvas, 1);
+  const size_t first_frame_end = recorded.data.size();
+  writer->Stream(*canvas, 2);
+  writer->Stream(*canvas, 3);
+  delete writer;
+  recorded.data[first_frame_end] ^= 0xff;  // Magic of frame 2.
+
+  SocketStreamIO *in, *out;
+  CreatePair(*canvas, *canvas, &in, &out);
+  StreamReader reader(in);
+  uint32_t hold_time_us = 0;
+  SendAll(out, recorded.data.data(), first_frame_end);
+  CHECK(reader.GetNext(canvas, &hold_time_us));
+  CHECK(hold_time_us == 1);
+
+  // Frame 2 is replaced by frame 3, but its header is checked anyway.
+  SendAll(out, recorded.data.data() + first_frame_end,
+          recorded.data.size() - first_frame_end);
+  CHECK(!reader.GetNext(canvas, &hold_time_us));
+  CHECK(!in->IsConnected());
+  delete in;
+  delete out;
+}
+
+int main(int argc, char *argv[]) {
+  signal(SIGPIPE, SIG_IGN);  // Writing to a connection the reader closed.
+  FrameCanvas *canvas = CreateCanvas(16, 32);
+  FrameCanvas *other = CreateCanvas(32, 32);
+  if (canvas == NULL || other == NULL)
+    return 1;
+
+  TestLatestFrameWins(canvas);
+  TestFrameSizeMismatch(canvas, other);
+  TestDesyncedStream(canvas);
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed.\n", failures);
+    return 1;
+  }
+  fprintf(stderr, "All checks passed.\n");
+  return 0;
+}
@@ -0,0 +1,98 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Re-encode a stream written with a StreamWriter (see content-streamer.h)
+// for a differently wired display: other pixel mappers, pwm-bits, hardware
+// mapping or parallel chains. Render once, deploy on many walls.
+//
+// The --led-* flags before the '--' describe the configuration the stream
+// was recorded with, the ones after the configuration to transcode to.
+
+#include "led-matrix.h"
+#include "content-streamer.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RuntimeOptions;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [source-led-flags] <input-stream> <output-stream>"
+          " -- [target-led-flags]\n", progname);
+  fprintf(stderr, "Flags describing source and target matrix:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+// Create a matrix that never touches the hardware; we only need its
+// FrameCanvas to decode or encode frames.
+static FrameCanvas *CreateCanvas(int *argc, char ***argv) {
+  RGBMatrix::Options options;
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;
+  runtime.daemon = -1;
+  runtime.drop_privileges = -1;
+  if (!rgb_matrix::ParseOptionsFromFlags(argc, argv, &options, &runtime))
+    return NULL;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(options, runtime);
+  if (matrix == NULL)
+    return NULL;
+  return matrix->CreateFrameCanvas();  // Matrix not deleted; we exit soon.
+}
+
+int main(int argc, char *argv[]) {
+  // Split the command line at '--' into source and target flags.
+  std::vector<char*> source_args;
+  std::vector<char*> target_args;
+  target_args.push_back(argv[0]);
+  std::vector<char*> *current = &source_args;
+  for (int i = 0; i < argc; ++i) {
+    if (current == &source_args && strcmp(argv[i], "--") == 0) {
+      current = &target_args;
+      continue;
+    }
+    current->push_back(argv[i]);
+  }
+  if (current != &target_args)
+    return usage(argv[0]);
+
+  int source_argc = source_args.size();
+  char **source_argv = source_args.data();
+  FrameCanvas *from = CreateCanvas(&source_argc, &source_argv);
+  if (from == NULL || source_argc != 3)
+    return usage(argv[0]);
+  const char *in_filename = source_argv[1];
+  const char *out_filename = source_argv[2];
+
+  int target_argc = target_args.size();
+  char **target_argv = target_args.data();
+  FrameCanvas *to = CreateCanvas(&target_argc, &target_argv);
+  if (to == NULL || target_argc != 1)
+    return usage(argv[0]);
+
+  const int in_fd = open(in_filename, O_RDONLY);
+  if (in_fd < 0) {
+    perror(in_filename);
+    return 1;
+  }
+  const int out_fd = open(out_filename, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  if (out_fd < 0) {
+    perror(out_filename);
+    return 1;
+  }
+
+  rgb_matrix::FileStreamIO in(in_fd);
+  rgb_matrix::FileStreamIO out(out_fd);
+  if (!rgb_matrix::TranscodeStream(&in, from, &out, to)) {
+    fprintf(stderr, "Could not transcode %s (%dx%d) to %dx%d\n",
+            in_filename, from->width(), from->height(),
+            to->width(), to->height());
+    return 1;
+  }
+  return 0;
+}